@@ -27,14 +27,79 @@ func handleMessage(_ argumentPtr: AnyPtr) {
     }
 }
 
+// Where a behaviour was called from. Only formatted when asked for, and only
+// kept with the message when built with FLYNN_MESSAGE_CALLSITE.
+@usableFromInline
+struct CallSite: CustomStringConvertible {
+    @usableFromInline
+    let file: StaticString
+    
+    @usableFromInline
+    let line: UInt64
+    
+    @usableFromInline
+    init(_ file: StaticString,
+         _ line: UInt64) {
+        self.file = file
+        self.line = line
+    }
+    
+    @usableFromInline
+    var description: String {
+        return "\(file):\(line)"
+    }
+}
+
+// The argument of a behaviour sent with unsafeSend(), stored directly in the
+// pony message rather than in an ActorMessage behind it.
+@usableFromInline
+struct InlineMessage {
+    @usableFromInline
+    let block: PonyBlock
+    
+    @usableFromInline
+    let thenId: UInt64
+    
+#if FLYNN_MESSAGE_CALLSITE
+    @usableFromInline
+    let callSite: CallSite
+#endif
+    
+    @usableFromInline
+    init(_ callSite: CallSite,
+         _ block: @escaping PonyBlock,
+         _ thenId: UInt64) {
+        self.block = block
+        self.thenId = thenId
+#if FLYNN_MESSAGE_CALLSITE
+        self.callSite = callSite
+#endif
+    }
+}
+
+@inlinable
+func handleInlineMessage(_ payload: AnyPtr) {
+    // The runtime frees the message after we return, so move the argument out
+    // of it to release the closure once it has run.
+    guard let payload = payload else { return }
+    let msg = payload.bindMemory(to: InlineMessage.self, capacity: 1).move()
+    msg.block(msg.thenId)
+}
+
 @usableFromInline
 class ActorMessage: CustomStringConvertible {
     
-    let callSite: String
+#if FLYNN_MESSAGE_CALLSITE
+    let callSite: CallSite
     
     public var description: String {
         return "ActorMessage: \(callSite)"
     }
+#else
+    public var description: String {
+        return "ActorMessage"
+    }
+#endif
     
     @usableFromInline
     var block: PonyBlock?
@@ -43,10 +108,12 @@ class ActorMessage: CustomStringConvertible {
     var thenId: UInt64
     
     @usableFromInline
-    init(_ callSite: String,
+    init(_ callSite: CallSite,
          _ block: @escaping PonyBlock,
          _ thenId: UInt64) {
+#if FLYNN_MESSAGE_CALLSITE
         self.callSite = callSite
+#endif
         self.block = block
         self.thenId = thenId
     }
@@ -67,7 +134,7 @@ open class Actor: Equatable, Hashable {
     struct WeakActor {
         weak var actor: Actor?
     }
-    private static var recordedActors: [String: WeakActor] = [:]
+    private static var recordedActors: [UInt64: WeakActor] = [:]
     private static var recordedActorsLock = NSLock()
     
     private static func releaseWeakActors() {
@@ -89,14 +156,14 @@ open class Actor: Equatable, Hashable {
         releaseWeakActors()
         
         recordedActorsLock.lock()
-        recordedActors[actor.unsafeUUID] = WeakActor(actor: actor)
+        recordedActors[actor.unsafeUID] = WeakActor(actor: actor)
         recordedActorsLock.unlock()
     }
     public static func release(actor: Actor) {
         releaseWeakActors()
         
         recordedActorsLock.lock()
-        recordedActors[actor.unsafeUUID] = nil
+        recordedActors[actor.unsafeUID] = nil
         recordedActorsLock.unlock()
     }
     public static func printLeakedActors() {
@@ -118,33 +185,53 @@ open class Actor: Equatable, Hashable {
     
     
     public static func == (lhs: Actor, rhs: Actor) -> Bool {
-        return lhs.unsafeUUID == rhs.unsafeUUID
+        return lhs.unsafeUID == rhs.unsafeUID
     }
     
     public func hash(into hasher: inout Hasher) {
-        hasher.combine(unsafeUUID)
+        hasher.combine(unsafeUID)
     }
     
-    public let unsafeUUID: String
+    // Unique for the life of the process; assigned by the runtime when the
+    // actor is created. Identity, hashing and lookups all use this.
+    public let unsafeUID: UInt64
     
-    private var _ponyActorPtr: AnyPtr
+    // Only for output meant for people. Formatted on demand from a random per
+    // process prefix and the uid, so creating an actor costs no UUID.
+    public var unsafeUUID: String {
+        return Actor.uuidString(unsafeUID)
+    }
     
-    private let _ponyActorLock = NSLock()
+    private static let uuidPrefix: UInt64 = UInt64.random(in: UInt64.min...UInt64.max)
+    
+    private static func hex16(_ value: UInt64) -> String {
+        let digits = String(value, radix: 16, uppercase: true)
+        return String(repeating: "0", count: 16 - digits.count) + digits
+    }
+    
+    private static func uuidString(_ uid: UInt64) -> String {
+        let chars = Array(hex16(Actor.uuidPrefix) + hex16(uid))
+        return String(chars[0..<8]) + "-" +
+               String(chars[8..<12]) + "-" +
+               String(chars[12..<16]) + "-" +
+               String(chars[16..<20]) + "-" +
+               String(chars[20..<32])
+    }
+    
+    // Guards the pony actor against being destroyed by unsafeCancel() or deinit
+    // while another thread is still sending to it. Acquiring it is a single
+    // atomic add; only the claim that destroys the actor ever waits.
+    private let _ponyActorRef: OpaquePointer?
     
     @discardableResult
     internal func safeWithActorPtr<R>(_ body: (UnsafeMutableRawPointer) -> R) -> R? {
-        _ponyActorLock.lock()
-        defer { _ponyActorLock.unlock() }
-        guard let actorPtr = _ponyActorPtr else { return nil }
+        guard let actorPtr = pony_actor_ref_acquire(_ponyActorRef) else { return nil }
+        defer { pony_actor_ref_release(_ponyActorRef) }
         return body(actorPtr)
     }
     
     private func claimActorPtr() -> UnsafeMutableRawPointer? {
-        _ponyActorLock.lock()
-        defer { _ponyActorLock.unlock() }
-        let ptr = _ponyActorPtr
-        _ponyActorPtr = nil
-        return ptr
+        return pony_actor_ref_claim(_ponyActorRef)
     }
     
     public var unsafeCoreAffinity: CoreAffinity {
@@ -169,6 +256,9 @@ open class Actor: Equatable, Hashable {
         }
     }
     
+    // Actors with a priority above 0 run ahead of those at the default of 0,
+    // which run ahead of those below it. Set it on control plane actors that
+    // must not queue behind bulk work.
     public var unsafePriority: Int32 {
         get {
             guard let val = safeWithActorPtr({ pony_actor_getpriority($0) }) else {
@@ -199,6 +289,25 @@ open class Actor: Equatable, Hashable {
         }
     }
     
+    /// Messages this actor's mailbox may hold before actors sending to it are
+    /// muted: held off the schedulers until the mailbox drains to half the
+    /// limit. Sends from outside any actor are never held back. Zero, the
+    /// default, leaves the mailbox unbounded.
+    public var unsafeMailboxLimit: Int32 {
+        get {
+            guard let val = safeWithActorPtr({ pony_actor_getmailboxLimit($0) }) else {
+                print("Warning: unsafeMailboxLimit called on a cancelled actor")
+                return 0
+            }
+            return val
+        }
+        set {
+            if safeWithActorPtr({ pony_actor_setmailboxLimit($0, newValue) }) == nil {
+                print("Warning: unsafeMailboxLimit called on a cancelled actor")
+            }
+        }
+    }
+    
     // MARK: - Functions
     public func unsafeWait(_ minMsgs: Int32 = 0) {
         if safeWithActorPtr({ pony_actor_wait(minMsgs, $0) }) == nil {
@@ -265,10 +374,11 @@ open class Actor: Equatable, Hashable {
     
     public init() {
         Flynn.startup()
-        unsafeUUID = UUID().uuidString
-        _ponyActorPtr = pony_actor_create()
+        let actorPtr = pony_actor_create()
+        unsafeUID = (actorPtr != nil) ? pony_actor_uid(actorPtr) : 0
+        _ponyActorRef = pony_actor_ref_create(actorPtr)
         
-        if let actorPtr = _ponyActorPtr {
+        if let actorPtr = actorPtr {
             pony_actor_setProfileTypeID(actorPtr, Flynn.Profiler.typeID(for: type(of: self)))
         }
         
@@ -292,6 +402,7 @@ open class Actor: Equatable, Hashable {
         if let actorPtr = claimActorPtr() {
             pony_actor_destroy(actorPtr)
         }
+        pony_actor_ref_free(_ponyActorRef)
         
 #if FLYNN_LEAK_ACTOR
         Actor.release(actor: self)
@@ -348,8 +459,12 @@ open class Actor: Equatable, Hashable {
                            _ line: UInt64 = #line) -> Self {
         let sent: Void? = safeWithActorPtr { actorPtr in
             let thenId = pony_actor_new_then_id()
-            let argumentPtr = Ptr(ActorMessage("\(file):\(line)", block, thenId))
-            pony_actor_send_message(actorPtr, argumentPtr, thenId, handleMessage)
+            guard let payload = pony_actor_alloc_inline_message(MemoryLayout<InlineMessage>.size) else {
+                print("Warning: unsafeSend could not allocate a message, the block at \(file):\(line) was dropped")
+                return
+            }
+            payload.initializeMemory(as: InlineMessage.self, repeating: InlineMessage(CallSite(file, line), block, thenId), count: 1)
+            pony_actor_send_inline_message(actorPtr, payload, thenId, handleInlineMessage)
         }
         if sent == nil {
             print("Warning: unsafeSend called on a cancelled actor")
@@ -357,6 +472,38 @@ open class Actor: Equatable, Hashable {
         return self
     }
     
+    // Sends every block to this actor with a single enqueue, to run in order.
+    // Meant for producers that hand many records to the same actor at once.
+    // The blocks are given a then id of 0, so a batch cannot be followed by a do.
+    @discardableResult
+    public func unsafeSendBatch(_ blocks: [PonyBlock],
+                                _ file: StaticString = #file,
+                                _ line: UInt64 = #line) -> Self {
+        guard blocks.isEmpty == false else { return self }
+        
+        let sent: Void? = safeWithActorPtr { actorPtr in
+            var payloads: [UnsafeMutableRawPointer?] = []
+            payloads.reserveCapacity(blocks.count)
+            // Stop at the first block we cannot allocate for: what is sent is
+            // then still the blocks in order, just fewer of them.
+            for block in blocks {
+                guard let payload = pony_actor_alloc_inline_message(MemoryLayout<InlineMessage>.size) else {
+                    print("Warning: unsafeSendBatch could not allocate a message, the last \(blocks.count - payloads.count) of \(blocks.count) blocks at \(file):\(line) were dropped")
+                    break
+                }
+                payload.initializeMemory(as: InlineMessage.self, repeating: InlineMessage(CallSite(file, line), block, 0), count: 1)
+                payloads.append(payload)
+            }
+            payloads.withUnsafeMutableBufferPointer { buffer in
+                pony_actor_send_batch(actorPtr, buffer.baseAddress, Int32(buffer.count), handleInlineMessage)
+            }
+        }
+        if sent == nil {
+            print("Warning: unsafeSendBatch called on a cancelled actor")
+        }
+        return self
+    }
+    
     // MARK: - Then -> Do
     @usableFromInline
     internal var safeThenMessages: [UInt64: UnsafeMutableRawPointer] = [:]
@@ -371,7 +518,7 @@ open class Actor: Equatable, Hashable {
                          _ column: UInt64 = #column) -> Self {
         let sent: Void? = safeWithActorPtr { actorPtr in
             let thenId = pony_actor_new_then_id()
-            let argumentPtr = Ptr(ActorMessage("\(file):\(line)", block, thenId))
+            let argumentPtr = Ptr(ActorMessage(CallSite(file, line), block, thenId))
             let prevThenId = pony_actor_get_then_id(file.utf8Start, line, column)
             
             guard prevThenId != 0 else {
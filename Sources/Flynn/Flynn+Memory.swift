@@ -0,0 +1,54 @@
+import Foundation
+import Pony
+
+extension Flynn {
+
+    public enum Memory {
+
+        public struct Sample: Codable {
+            public let thread: Int
+            public let size: Int
+            public let hits: UInt64
+            public let depotTakes: UInt64
+            public let slabCarves: UInt64
+            public let frees: UInt64
+            public let depotPuts: UInt64
+            public let held: UInt64
+
+            public var allocations: UInt64 { hits + slabCarves }
+            public var hitRate: Double { allocations == 0 ? 0 : Double(hits) / Double(allocations) }
+        }
+
+        // Bytes Flynn currently has mapped for its pools and large allocations.
+        public static var mapped: UInt64 {
+            return UInt64(pony_mapped_memory())
+        }
+
+        public static var classCount: Int {
+            return Int(pony_pool_class_count())
+        }
+
+        // One sample per thread and size class that has seen any pool traffic.
+        // Counters are cumulative for as long as the thread lives.
+        public static func collect(maxThreads: Int = 256) -> [Sample] {
+            let maxStats = maxThreads * Int(pony_pool_class_count())
+            guard maxStats > 0 else { return [] }
+
+            var stats = [pony_pool_stats_t](repeating: pony_pool_stats_t(), count: maxStats)
+            let n = Int(pony_pool_stats(&stats, Int32(maxStats)))
+
+            var samples: [Sample] = []
+            for idx in 0..<n {
+                samples.append(Sample(thread: Int(stats[idx].thread),
+                                      size: Int(stats[idx].size),
+                                      hits: stats[idx].hits,
+                                      depotTakes: stats[idx].depot_takes,
+                                      slabCarves: stats[idx].slab_carves,
+                                      frees: stats[idx].frees,
+                                      depotPuts: stats[idx].depot_puts,
+                                      held: stats[idx].held))
+            }
+            return samples
+        }
+    }
+}
@@ -0,0 +1,67 @@
+import Foundation
+import Pony
+
+extension Flynn {
+
+    public enum Scheduler {
+
+        public struct Sample: Codable {
+            public let index: Int
+            public let steals: UInt64
+            public let stolenActors: UInt64
+            public let largestSteal: UInt64
+            public let spinHits: UInt64
+            public let parks: UInt64
+            public let idleGapNS: UInt64
+            public let spinNS: UInt64
+
+            public var actorsPerSteal: Double { steals == 0 ? 0 : Double(stolenActors) / Double(steals) }
+            public var spinHitRate: Double { spinHits + parks == 0 ? 0 : Double(spinHits) / Double(spinHits + parks) }
+        }
+
+        public static var count: Int {
+            return Int(pony_scheduler_count())
+        }
+
+        // Schedulers not currently suspended. Always equal to count unless
+        // Flynn was started with a minActiveSchedulerCount.
+        public static var activeCount: Int {
+            return Int(pony_active_scheduler_count())
+        }
+
+        // Most actors a single steal may move from a victim's queue. Set with
+        // the FLYNN_STEAL_BATCH environment variable before startup.
+        public static var stealBatchLimit: Int {
+            return Int(pony_steal_batch_max())
+        }
+
+        // Longest an idle scheduler will spin before parking, in microseconds.
+        // Each scheduler spins for less, or not at all, if work does not
+        // usually arrive that soon. Set with the FLYNN_SPIN_MAX_US environment
+        // variable before startup; 0 parks at once.
+        public static var spinLimitUS: Int {
+            return Int(pony_spin_max_us())
+        }
+
+        public static func collect() -> [Sample] {
+            let maxSchedulers = Int(pony_scheduler_count())
+            guard maxSchedulers > 0 else { return [] }
+
+            var stats = [pony_scheduler_stats_t](repeating: pony_scheduler_stats_t(), count: maxSchedulers)
+            let n = Int(pony_scheduler_stats(&stats, Int32(maxSchedulers)))
+
+            var samples: [Sample] = []
+            for idx in 0..<n {
+                samples.append(Sample(index: idx,
+                                      steals: stats[idx].steals,
+                                      stolenActors: stats[idx].stolen_actors,
+                                      largestSteal: stats[idx].largest_steal,
+                                      spinHits: stats[idx].spin_hits,
+                                      parks: stats[idx].parks,
+                                      idleGapNS: stats[idx].idle_gap_ns,
+                                      spinNS: stats[idx].spin_ns))
+            }
+            return samples
+        }
+    }
+}
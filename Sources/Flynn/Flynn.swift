@@ -32,6 +32,23 @@ public class MainActor: Actor {
         return self
     }
     
+    @discardableResult
+    public override func unsafeSendBatch(_ blocks: [PonyBlock],
+                                         _ file: StaticString = #file,
+                                         _ line: UInt64 = #line) -> Self {
+        let result: Void? = safeWithActorPtr { actorPtr in
+            DispatchQueue.main.async {
+                for block in blocks {
+                    block(0)
+                }
+            }
+        }
+        if result == nil {
+            print("Warning: unsafeSendBatch called on a cancelled actor")
+        }
+        return self
+    }
+    
     @discardableResult
     public override func unsafeDo(_ block: @escaping PonyBlock,
                                   _ file: StaticString = #file,
@@ -76,6 +93,9 @@ open class Flynn {
 
     public class func startup(schedulerCount: Int = 0,
                               minSchedulerCount: Int = 0,
+                              minActiveSchedulerCount: Int = 0,
+                              schedulerSuspendAfterMS: Int = 0,
+                              schedulerReviveBacklog: Int = 0,
                               memoryTrimLimit: Int = 0) {
         running.checkInactive {
             if memoryTrimLimit > 0 {
@@ -87,7 +107,11 @@ open class Flynn {
 
             timerLoop = TimerLoop()
             
-            pony_startup(Int32(schedulerCount), Int32(minSchedulerCount))
+            pony_startup(Int32(schedulerCount),
+                         Int32(minSchedulerCount),
+                         Int32(minActiveSchedulerCount),
+                         Int32(schedulerSuspendAfterMS),
+                         Int32(schedulerReviveBacklog))
             
             if memoryTrimLimit > 0 {
                 let actor = Actor()
@@ -132,7 +156,7 @@ open class Flynn {
     }
     
     public class func undock(_ actor: Actor) {
-        dockedQueue.dequeueAny { $0.unsafeUUID == actor.unsafeUUID }
+        dockedQueue.dequeueAny { $0.unsafeUID == actor.unsafeUID }
     }
 
     public static var cores: Int {
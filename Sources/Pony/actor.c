@@ -14,17 +14,68 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-#define MAX_THEN 1024
-
-static __pony_thread_local uint64_t sendv_marked_idx_push = 0;
-static __pony_thread_local uint64_t sendv_marked_idx_pop = 0;
+// ******** then/do matching ********
+//
+// then() marks the then id of the behaviour call it follows, keyed by its call
+// site; the do() that comes after it looks the mark back up by its own call
+// site. The two sites are never identical -- they sit at different columns,
+// often on different lines -- so a do() takes the nearest outstanding mark
+// within a few lines of it, and of equally near marks the oldest.
+//
+// Marks are grouped by exact call site, oldest first, and the groups hang off
+// a small hash table keyed by line. A lookup visits the handful of lines a
+// match can be on rather than every outstanding mark, so a behaviour that
+// issues many then/do pairs in a loop stays linear. Everything is thread local
+// and is cleared after each behaviour.
+
+#define THEN_MAX_DISTANCE 4096
+#define THEN_LINE_WINDOW (THEN_MAX_DISTANCE / 1024)
+#define THEN_NONE UINT32_MAX
+#define THEN_INITIAL_CAPACITY 64
+
+// Entries above this are given back when a behaviour finishes rather than kept
+// for the next one.
+#define THEN_RETAINED_CAPACITY 1024
+
+typedef struct then_mark_t {
+    uint64_t then_id;
+    const void * file;
+    uint64_t line;
+    uint32_t group;
+    uint32_t next;
+    bool live;
+} then_mark_t;
+
+typedef struct then_group_t {
+    uint64_t hash;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t next;
+} then_group_t;
+
+typedef struct then_slot_t {
+    uint64_t line_key;      // line + 1; 0 is an empty slot
+    uint32_t first_group;
+} then_slot_t;
+
+typedef struct then_state_t {
+    then_mark_t* marks;
+    uint32_t mark_count;
+    uint32_t mark_capacity;
+    uint32_t live;
+    uint32_t oldest;
+    
+    then_group_t* groups;
+    uint32_t group_count;
+    uint32_t group_capacity;
+    
+    then_slot_t* slots;
+    uint32_t slot_count;
+    uint32_t slot_capacity;
+} then_state_t;
 
 static __pony_thread_local uint64_t sendv_last_then_id = 0;
-static __pony_thread_local uint64_t sendv_marked_then_id[MAX_THEN] = {0};
-static __pony_thread_local uint64_t sendv_marked_then_id_hash[MAX_THEN] = {0};
-
-static __pony_thread_local const void * sendv_marked_then_id_file[MAX_THEN] = {0};
-static __pony_thread_local uint64_t sendv_marked_then_id_line[MAX_THEN] = {0};
+static __pony_thread_local then_state_t then_state = {0};
 
 void ponyint_actor_destroy(pony_actor_t* actor);
 
@@ -42,16 +93,24 @@ static void set_flag(pony_actor_t* actor, uint8_t flag)
     atomic_store_explicit(&actor->flags, flags | flag, memory_order_relaxed);
 }
 
+// Suspended by the user or muted by backpressure; either keeps an actor off the
+// schedulers until the other side releases it.
+static bool actor_held(pony_actor_t* actor)
+{
+    return atomic_load_explicit(&actor->suspended, memory_order_seq_cst) ||
+        atomic_load_explicit(&actor->muted, memory_order_seq_cst);
+}
+
 static bool actor_park(pony_actor_t* actor)
 {
     atomic_store_explicit(&actor->parked, true, memory_order_seq_cst);
     
-    if(atomic_load_explicit(&actor->suspended, memory_order_seq_cst)) {
-        // Still suspended. ponyint_resume_actor() owns the actor now.
+    if(actor_held(actor)) {
+        // Still held. Whoever releases the actor owns it now.
         return false;
     }
     
-    // Resumed underneath us. Whoever wins the exchange does the rescheduling.
+    // Released underneath us. Whoever wins the exchange does the rescheduling.
     return atomic_exchange_explicit(&actor->parked, false, memory_order_acq_rel);
 }
 
@@ -61,6 +120,379 @@ static bool actor_unsuspend(pony_actor_t* actor)
     return atomic_exchange_explicit(&actor->parked, false, memory_order_acq_rel);
 }
 
+// ******** backpressure ********
+//
+// A send to an actor over its mailbox limit mutes the sending actor there and
+// then, pushing it onto the receiver's muted_senders while the send still
+// keeps the receiver alive; the sender stops its batch after the current
+// message. The receiver checks that list after each batch and, once it has
+// drained to half its limit, takes the whole list and unmutes everyone on it.
+//
+// As in Pony, a sender is never muted while its own mailbox is over its limit,
+// while it is already muted, or on a receiver that is itself muted: any of
+// those can close a cycle of actors each waiting for another to drain, which
+// none of them ever would.
+//
+// Only whoever takes a sender off a list unmutes it, and a muted actor starts
+// no further behaviours, so an actor is on at most one list at a time. One
+// that is being destroyed is never muted, so it is never freed while on one.
+
+static void actor_unmute(pony_ctx_t* ctx, pony_actor_t* actor)
+{
+    atomic_store_explicit(&actor->muted, false, memory_order_seq_cst);
+    if(atomic_exchange_explicit(&actor->parked, false, memory_order_acq_rel)) {
+        ponyint_sched_add(ctx, actor);
+    }
+}
+
+static void actor_unmute_senders(pony_ctx_t* ctx, pony_actor_t* actor)
+{
+    pony_actor_t* sender = atomic_exchange_explicit(&actor->muted_senders, NULL, memory_order_acquire);
+    while(sender != NULL) {
+        // Read the link first; once unmuted the sender may run and be muted
+        // again elsewhere.
+        pony_actor_t* next = sender->mute_next;
+        actor_unmute(ctx, sender);
+        sender = next;
+    }
+}
+
+static bool actor_mailbox_drained(pony_actor_t* actor)
+{
+    int32_t limit = actor->mailboxLimit;
+    return limit <= 0 || ponyint_messageq_count(&actor->queue) <= limit / 2;
+}
+
+static void actor_release_senders(pony_ctx_t* ctx, pony_actor_t* actor)
+{
+    if(atomic_load_explicit(&actor->muted_senders, memory_order_relaxed) == NULL) {
+        return;
+    }
+    if(actor_mailbox_drained(actor)) {
+        actor_unmute_senders(ctx, actor);
+    }
+}
+
+static void actor_mute(pony_ctx_t* ctx, pony_actor_t* actor, pony_actor_t* receiver)
+{
+    atomic_store_explicit(&actor->muted, true, memory_order_seq_cst);
+    
+    pony_actor_t* head = atomic_load_explicit(&receiver->muted_senders, memory_order_relaxed);
+    do {
+        actor->mute_next = head;
+    } while(!atomic_compare_exchange_weak_explicit(&receiver->muted_senders, &head, actor,
+                                                   memory_order_release, memory_order_relaxed));
+    
+    // The receiver may have drained and checked its list before we were on it.
+    atomic_thread_fence(memory_order_seq_cst);
+    if(actor_mailbox_drained(receiver)) {
+        actor_unmute_senders(ctx, receiver);
+    }
+}
+
+// ******** waiting ********
+//
+// A thread in ponyint_actors_wait() puts itself on wait_list, raises each
+// actor's wait_threshold and parks. An actor that finishes a message at or
+// below its threshold clears the threshold and wakes everyone on the list;
+// each waiter re-checks its own actors and, if it must keep waiting, raises the
+// thresholds again. The list and the thresholds only change under wait_mutex,
+// and the park's latch covers a wake that lands before the wait.
+//
+// The wait is on the sum over the actors, so no single actor's count says when
+// it is over. What is known is how far the sum still has to fall: however that
+// is split between n actors, one of them has to fall by at least an nth of it.
+// Each actor is armed that far below its current count, and the waiter re-arms
+// from the new counts whenever one gets there. That wakes it a few times per
+// wait rather than on every message.
+
+// Only a backstop; every wait that can end is woken well before this.
+#define WAIT_BACKSTOP_US 100000
+
+typedef struct actor_waiter_t {
+    pony_park_t park;
+    struct actor_waiter_t* next;
+} actor_waiter_t;
+
+static PONY_ATOMIC(PONY_MUTEX) wait_mutex;
+static actor_waiter_t* wait_list;
+
+static PONY_MUTEX actor_wait_mutex()
+{
+    PONY_MUTEX mutex = atomic_load_explicit(&wait_mutex, memory_order_acquire);
+    if(mutex != NULL) {
+        return mutex;
+    }
+    
+    PONY_MUTEX fresh = ponyint_mutex_create();
+    if(atomic_compare_exchange_strong_explicit(&wait_mutex, &mutex, fresh,
+                                               memory_order_acq_rel, memory_order_acquire)) {
+        return fresh;
+    }
+    ponyint_mutex_destroy(fresh);
+    return mutex;
+}
+
+static void actor_notify_waiters(pony_actor_t* actor)
+{
+    int32_t threshold = atomic_load_explicit(&actor->wait_threshold, memory_order_relaxed);
+    if(threshold < 0 || ponyint_messageq_count(&actor->queue) > threshold) {
+        return;
+    }
+    
+    PONY_MUTEX mutex = actor_wait_mutex();
+    ponyint_mutex_lock(mutex);
+    atomic_store_explicit(&actor->wait_threshold, -1, memory_order_relaxed);
+    for(actor_waiter_t* waiter = wait_list; waiter != NULL; waiter = waiter->next) {
+        ponyint_park_wake(&waiter->park);
+    }
+    ponyint_mutex_unlock(mutex);
+}
+
+bool ponyint_actors_should_wait(int32_t min_msgs, pony_actor_t** actors, int num_actors)
+{
+    int32_t n = 0;
+    for (int i = 0; i < num_actors; i++) {
+        n += ponyint_messageq_count(&actors[i]->queue);
+    }
+    return n > min_msgs;
+}
+
+void ponyint_actors_wait(int32_t min_msgs, pony_actor_t** actors, int num_actors)
+{
+    if(!ponyint_actors_should_wait(min_msgs, actors, num_actors)) {
+        return;
+    }
+    
+    PONY_MUTEX mutex = actor_wait_mutex();
+    actor_waiter_t waiter;
+    ponyint_park_init(&waiter.park);
+    
+    ponyint_mutex_lock(mutex);
+    waiter.next = wait_list;
+    wait_list = &waiter;
+    ponyint_mutex_unlock(mutex);
+    
+    // The shares only add up if every threshold comes from the same counts:
+    // one taken later, after some draining, could leave no actor armed at all.
+    int32_t* counts = (int32_t*)ponyint_pool_alloc(num_actors * sizeof(int32_t));
+    
+    while(true) {
+        int64_t excess = -(int64_t)min_msgs;
+        for (int i = 0; i < num_actors; i++) {
+            counts[i] = ponyint_messageq_count(&actors[i]->queue);
+            excess += counts[i];
+        }
+        if(excess <= 0) {
+            break;
+        }
+        int64_t share = (excess + num_actors - 1) / num_actors;
+        
+        // Another waiter may already have armed an actor higher than we would;
+        // leave it, as waking early only costs that waiter a re-check.
+        ponyint_mutex_lock(mutex);
+        for (int i = 0; i < num_actors; i++) {
+            int64_t threshold = (int64_t)counts[i] - share;
+            int32_t armed = atomic_load_explicit(&actors[i]->wait_threshold, memory_order_relaxed);
+            if(threshold > armed) {
+                atomic_store_explicit(&actors[i]->wait_threshold, (int32_t)threshold, memory_order_relaxed);
+            }
+        }
+        ponyint_mutex_unlock(mutex);
+        
+        // Pairs with the fence at the end of ponyint_actor_run(): either the
+        // actor sees our threshold, or we see the messages it has finished.
+        atomic_thread_fence(memory_order_seq_cst);
+        
+        if(!ponyint_actors_should_wait(min_msgs, actors, num_actors)) {
+            break;
+        }
+        
+        // An actor that was already past its threshold when we armed it will
+        // not wake us until it next finishes a message; look again instead.
+        bool reached = false;
+        for (int i = 0; i < num_actors && !reached; i++) {
+            int32_t armed = atomic_load_explicit(&actors[i]->wait_threshold, memory_order_relaxed);
+            reached = armed >= 0 && ponyint_messageq_count(&actors[i]->queue) <= armed;
+        }
+        if(!reached) {
+            ponyint_park_wait(&waiter.park, WAIT_BACKSTOP_US);
+        }
+    }
+    
+    ponyint_pool_free(counts, num_actors * sizeof(int32_t));
+    
+    ponyint_mutex_lock(mutex);
+    actor_waiter_t** link = &wait_list;
+    while(*link != &waiter) {
+        link = &(*link)->next;
+    }
+    *link = waiter.next;
+    ponyint_mutex_unlock(mutex);
+    
+    ponyint_park_destroy(&waiter.park);
+}
+
+static bool actor_over_limit(pony_actor_t* actor)
+{
+    int32_t limit = actor->mailboxLimit;
+    return limit > 0 && ponyint_messageq_count(&actor->queue) > limit;
+}
+
+static inline void actor_check_mailbox(pony_ctx_t* ctx, pony_actor_t* to)
+{
+    pony_actor_t* current = ctx->current;
+    if(to->mailboxLimit <= 0 || current == NULL || current == to || current->destroy) {
+        return;
+    }
+    if(!actor_over_limit(to) ||
+       actor_over_limit(current) ||
+       atomic_load_explicit(&current->muted, memory_order_relaxed) ||
+       atomic_load_explicit(&to->muted, memory_order_relaxed)) {
+        return;
+    }
+    actor_mute(ctx, current, to);
+}
+
+static inline uint64_t then_hash(const void * file, uint64_t line, uint64_t column)
+{
+    return ((uint64_t)file) + line * 1024 + column;
+}
+
+static bool then_grow(void** array, uint32_t* capacity, size_t element)
+{
+    uint32_t grown = (*capacity == 0) ? THEN_INITIAL_CAPACITY : *capacity * 2;
+    void* p = realloc(*array, grown * element);
+    if (p == NULL) {
+        return false;
+    }
+    *array = p;
+    *capacity = grown;
+    return true;
+}
+
+static then_slot_t* then_slot(then_state_t* s, uint64_t line, bool create)
+{
+    if (s->slot_capacity == 0) {
+        if (!create) {
+            return NULL;
+        }
+        s->slots = (then_slot_t*)calloc(THEN_INITIAL_CAPACITY, sizeof(then_slot_t));
+        if (s->slots == NULL) {
+            return NULL;
+        }
+        s->slot_capacity = THEN_INITIAL_CAPACITY;
+    }
+    
+    if (create && (s->slot_count + 1) * 2 > s->slot_capacity) {
+        // Keep the table at most half full; rehash every line into one twice
+        // the size.
+        uint32_t old_capacity = s->slot_capacity;
+        then_slot_t* old = s->slots;
+        then_slot_t* fresh = (then_slot_t*)calloc(old_capacity * 2, sizeof(then_slot_t));
+        if (fresh == NULL) {
+            return NULL;
+        }
+        s->slots = fresh;
+        s->slot_capacity = old_capacity * 2;
+        for (uint32_t i = 0; i < old_capacity; i++) {
+            if (old[i].line_key == 0) {
+                continue;
+            }
+            uint32_t j = (uint32_t)(old[i].line_key * 0x9E3779B97F4A7C15ULL >> 32) & (s->slot_capacity - 1);
+            while (fresh[j].line_key != 0) {
+                j = (j + 1) & (s->slot_capacity - 1);
+            }
+            fresh[j] = old[i];
+        }
+        free(old);
+    }
+    
+    uint64_t key = line + 1;
+    uint32_t i = (uint32_t)(key * 0x9E3779B97F4A7C15ULL >> 32) & (s->slot_capacity - 1);
+    while (s->slots[i].line_key != 0) {
+        if (s->slots[i].line_key == key) {
+            return &s->slots[i];
+        }
+        i = (i + 1) & (s->slot_capacity - 1);
+    }
+    
+    if (!create) {
+        return NULL;
+    }
+    s->slots[i].line_key = key;
+    s->slots[i].first_group = THEN_NONE;
+    s->slot_count++;
+    return &s->slots[i];
+}
+
+static void then_reset()
+{
+    then_state_t* s = &then_state;
+    sendv_last_then_id = 0;
+    
+    if (s->mark_count == 0) {
+        return;
+    }
+    
+    if (s->slot_count > 0) {
+        memset(s->slots, 0, s->slot_capacity * sizeof(then_slot_t));
+    }
+    s->slot_count = 0;
+    s->mark_count = 0;
+    s->group_count = 0;
+    s->live = 0;
+    s->oldest = 0;
+    
+    if (s->mark_capacity > THEN_RETAINED_CAPACITY) {
+        free(s->marks);
+        free(s->groups);
+        free(s->slots);
+        memset(s, 0, sizeof(then_state_t));
+    }
+}
+
+// The oldest then() that no do() has claimed, if any.
+static then_mark_t* then_unclaimed()
+{
+    then_state_t* s = &then_state;
+    if (s->live == 0) {
+        return NULL;
+    }
+    while (!s->marks[s->oldest].live) {
+        s->oldest++;
+    }
+    return &s->marks[s->oldest];
+}
+
+static uint64_t then_claim(then_state_t* s, uint32_t group_index)
+{
+    then_group_t* group = &s->groups[group_index];
+    then_mark_t* mark = &s->marks[group->head];
+    
+    group->head = mark->next;
+    if (group->head == THEN_NONE) {
+        group->tail = THEN_NONE;
+    }
+    mark->live = false;
+    s->live--;
+    return mark->then_id;
+}
+
+static void actor_run_behavior(void (*func)(void * message), void* arg)
+{
+    then_reset();
+    func(arg);
+    
+    then_mark_t* unclaimed = then_unclaimed();
+    if (unclaimed != NULL) {
+        fprintf(stderr, "Unbalanced then/do detected at %s:%lu\n", (const char *)unclaimed->file, (unsigned long)unclaimed->line);
+        //exit(55);
+    }
+    
+    then_reset();
+}
+
 int ponyint_actor_run(pony_ctx_t* ctx, pony_actor_t* actor, int max_msgs)
 {
     pony_msg_t* msg;
@@ -68,33 +500,25 @@ int ponyint_actor_run(pony_ctx_t* ctx, pony_actor_t* actor, int max_msgs)
     
     atomic_store_explicit(&actor->yield, false, memory_order_relaxed);
     
-    if(atomic_load_explicit(&actor->suspended, memory_order_acquire)) {
+    if(actor_held(actor)) {
         return actor_park(actor) ? 1 : 0;
     }
     
+    ctx->current = actor;
+    
     while((msg = (pony_msg_t *)ponyint_actor_messageq_pop(&actor->queue)) != NULL) {
         
         switch(msg->msgId) {
             case kMessagePointer: {
                 pony_msgfunc_t * m = (pony_msgfunc_t *)msg;
                 if (m->func != NULL) {
-                    sendv_last_then_id = 0;
-                    sendv_marked_idx_push = 0;
-                    sendv_marked_idx_pop = 0;
-                    m->func(m->arg);
-                    
-                    if (sendv_marked_idx_push != sendv_marked_idx_pop) {
-                        const char * file = sendv_marked_then_id_file[sendv_marked_idx_pop];
-                        uint64_t line = sendv_marked_then_id_line[sendv_marked_idx_pop];
-                        fprintf(stderr, "Unbalanced then/do detected at %s:%lu\n", file, (unsigned long)line);
-                        //exit(55);
-                    }
-                    
-                    sendv_last_then_id = 0;
-                    sendv_marked_idx_push = 0;
-                    sendv_marked_idx_pop = 0;
+                    actor_run_behavior(m->func, m->arg);
                 }
             } break;
+            case kMessageInline: {
+                pony_msginline_t * m = (pony_msginline_t *)msg;
+                actor_run_behavior(m->func, m + 1);
+            } break;
             case kDestroyMessage: {
                 actor->destroy = true;
             } break;
@@ -102,14 +526,27 @@ int ponyint_actor_run(pony_ctx_t* ctx, pony_actor_t* actor, int max_msgs)
         
         ponyint_actor_messageq_pop_mark_done(&actor->queue);
         
+        actor_notify_waiters(actor);
+        
         n++;
         if (n > max_msgs ||
+            atomic_load_explicit(&actor->muted, memory_order_relaxed) ||
             atomic_load_explicit(&actor->yield, memory_order_relaxed) ||
             atomic_load_explicit(&actor->suspended, memory_order_relaxed)) {
             break;
         }
     }
     
+    ctx->current = NULL;
+    
+    // Pairs with the fences in actor_mute() and ponyint_actors_wait(): either
+    // we see the muted sender or the waiter, or it sees the messages we have
+    // just finished.
+    atomic_thread_fence(memory_order_seq_cst);
+    
+    actor_release_senders(ctx, actor);
+    actor_notify_waiters(actor);
+    
     if (actor->destroy) {
         // Note this is checked before the suspended/park branch below on purpose:
         // a destroying actor must never park, or it would never be freed.
@@ -117,14 +554,18 @@ int ponyint_actor_run(pony_ctx_t* ctx, pony_actor_t* actor, int max_msgs)
             return 1;
         }
         
+        // Nothing may stay muted on an actor that is going away.
+        actor_unmute_senders(ctx, actor);
+        
         ponyint_actor_setpendingdestroy(actor);
         ponyint_actor_destroy(actor);
         return -1;
     }
     
-    // A behaviour may have suspended us part way through the batch. The queue
-    // can still hold messages, so we must not mark it empty -- park instead.
-    if(atomic_load_explicit(&actor->suspended, memory_order_acquire)) {
+    // A behaviour may have suspended us part way through the batch, or we may
+    // have just been muted. The queue can still hold messages, so we must not
+    // mark it empty -- park instead.
+    if(actor_held(actor)) {
         return actor_park(actor) ? 1 : 0;
     }
     
@@ -150,6 +591,15 @@ void ponyint_actor_setbatchSize(pony_actor_t* actor, int32_t batchSize)
     actor->batchSize = batchSize;
 }
 
+int32_t ponyint_actor_getmailboxLimit(pony_actor_t* actor) {
+    return actor->mailboxLimit;
+}
+
+void ponyint_actor_setmailboxLimit(pony_actor_t* actor, int32_t mailboxLimit)
+{
+    actor->mailboxLimit = mailboxLimit;
+}
+
 int32_t ponyint_actor_getcoreAffinity(pony_actor_t* actor) {
     return actor->coreAffinity;
 }
@@ -195,7 +645,7 @@ void ponyint_actor_destroy(pony_actor_t* actor)
     
     pony_msg_t* head = atomic_load_explicit(&actor->queue.head, memory_order_acquire);
     if(((uintptr_t)head & (uintptr_t)1) != (uintptr_t)1) {
-        pony_syslog2("Flynn", "ponyint_actor_destroy: queue not empty for actor %d, leaking", actor->uid);
+        pony_syslog2("Flynn", "ponyint_actor_destroy: queue not empty for actor %llu, leaking", (unsigned long long)actor->uid);
         return;
     }
     
@@ -224,11 +674,7 @@ void ponyint_actor_setpendingdestroy(pony_actor_t* actor)
 
 size_t ponyint_actor_num_messages(pony_actor_t* actor)
 {
-    size_t n = actor->queue.num_messages;
-    if (n < 0) {
-        return 0;
-    }
-    return n;
+    return (size_t)ponyint_messageq_count(&actor->queue);
 }
 
 pony_actor_t* ponyint_create_actor(pony_ctx_t* ctx)
@@ -238,10 +684,11 @@ pony_actor_t* ponyint_create_actor(pony_ctx_t* ctx)
     
     memset(actor, 0, typeSize);
     
-    static PONY_ATOMIC(int32_t) actorUID = 1;
+    static PONY_ATOMIC(uint64_t) actorUID = 1;
     actor->uid = atomic_fetch_add_explicit(&actorUID, 1, memory_order_relaxed);
     actor->coreAffinity = kCoreAffinity_None;
     actor->batchSize = 1000;
+    actor->wait_threshold = -1;
     
     ponyint_messageq_init(&actor->queue);
 
@@ -249,70 +696,115 @@ pony_actor_t* ponyint_create_actor(pony_ctx_t* ctx)
 }
 
 void pony_actor_mark_then_id(const void * file, uint64_t line, uint64_t column) {
+    then_state_t* s = &then_state;
+    uint64_t callerHash = then_hash(file, line, column);
     
-    uint64_t next_idx = (sendv_marked_idx_push + 1) % MAX_THEN;
+    if (s->mark_count == s->mark_capacity &&
+        !then_grow((void**)&s->marks, &s->mark_capacity, sizeof(then_mark_t))) {
+        fprintf(stderr, "Fatal Error: out of memory for then/do at %s:%lu\n", (const char * )file, (unsigned long)line);
+        exit(55);
+    }
     
-    if (next_idx == sendv_marked_idx_pop) {
-        fprintf(stderr, "Fatal Error: then/do stack size exceeded at %s:%lu\n", (const char * )file, (unsigned long)line);
+    then_slot_t* slot = then_slot(s, line, true);
+    if (slot == NULL) {
+        fprintf(stderr, "Fatal Error: out of memory for then/do at %s:%lu\n", (const char * )file, (unsigned long)line);
         exit(55);
     }
     
-    uint64_t callerHash = ((uint64_t)file) + line * 1024 + column;
-
-    // fprintf(stderr, "THEN_STACK: PUSH ID %llu IDX %llu HASH %llu\n", sendv_last_then_id, sendv_marked_idx_push, callerHash);
-    sendv_marked_then_id[sendv_marked_idx_push] = sendv_last_then_id;
-    sendv_marked_then_id_file[sendv_marked_idx_push] = file;
-    sendv_marked_then_id_line[sendv_marked_idx_push] = line;
-    sendv_marked_then_id_hash[sendv_marked_idx_push] = callerHash;
-    sendv_marked_idx_push = next_idx;
-
+    uint32_t group_index = slot->first_group;
+    while (group_index != THEN_NONE && s->groups[group_index].hash != callerHash) {
+        group_index = s->groups[group_index].next;
+    }
+    
+    if (group_index == THEN_NONE) {
+        if (s->group_count == s->group_capacity &&
+            !then_grow((void**)&s->groups, &s->group_capacity, sizeof(then_group_t))) {
+            fprintf(stderr, "Fatal Error: out of memory for then/do at %s:%lu\n", (const char * )file, (unsigned long)line);
+            exit(55);
+        }
+        group_index = s->group_count++;
+        then_group_t* group = &s->groups[group_index];
+        group->hash = callerHash;
+        group->head = THEN_NONE;
+        group->tail = THEN_NONE;
+        group->next = slot->first_group;
+        slot->first_group = group_index;
+    }
+    
+    uint32_t mark_index = s->mark_count++;
+    then_mark_t* mark = &s->marks[mark_index];
+    mark->then_id = sendv_last_then_id;
+    mark->file = file;
+    mark->line = line;
+    mark->group = group_index;
+    mark->next = THEN_NONE;
+    mark->live = true;
+    s->live++;
+    
+    then_group_t* group = &s->groups[group_index];
+    if (group->tail == THEN_NONE) {
+        group->head = mark_index;
+    } else {
+        s->marks[group->tail].next = mark_index;
+    }
+    group->tail = mark_index;
+    
     sendv_last_then_id = 0;
 }
 
 uint64_t pony_actor_get_then_id(const void * file, uint64_t line, uint64_t column) {
-    if (sendv_marked_idx_push == sendv_marked_idx_pop) { return 0; }
+    then_state_t* s = &then_state;
+    if (s->live == 0) { return 0; }
     
     // We are allowed to match any previous then which matches our source code hash
-    uint64_t callerHash = ((uint64_t)file) + line * 1024 + column;
-    
-    
-    uint64_t potentialIdx = sendv_marked_idx_push;
-    uint64_t potentialIdxDistance = 9999999999999;
-    
-    uint64_t idx = sendv_marked_idx_pop;
-    while (idx != sendv_marked_idx_push) {
-        uint64_t markedHash = sendv_marked_then_id_hash[idx];
-        if (markedHash != 0) {
-            uint64_t idxDistance = markedHash > callerHash ? markedHash - callerHash : callerHash - markedHash;
-            
-            // fprintf(stderr, "CHECK_STACK: IDX %llu with distance %llu\n", idx, idxDistance);
-            if (idxDistance < potentialIdxDistance) {
-                potentialIdxDistance = idxDistance;
-                potentialIdx = idx;
+    uint64_t callerHash = then_hash(file, line, column);
+    
+    uint32_t best = THEN_NONE;
+    uint64_t bestDistance = THEN_MAX_DISTANCE;
+    uint32_t bestHead = THEN_NONE;
+    
+    uint64_t first = (line > THEN_LINE_WINDOW) ? line - THEN_LINE_WINDOW : 0;
+    for (uint64_t l = first; l <= line + THEN_LINE_WINDOW; l++) {
+        then_slot_t* slot = then_slot(s, l, false);
+        if (slot == NULL) {
+            continue;
+        }
+        for (uint32_t g = slot->first_group; g != THEN_NONE; g = s->groups[g].next) {
+            then_group_t* group = &s->groups[g];
+            if (group->head == THEN_NONE) {
+                continue;
+            }
+            uint64_t distance = group->hash > callerHash ? group->hash - callerHash : callerHash - group->hash;
+            if (distance < bestDistance || (distance == bestDistance && best != THEN_NONE && group->head < bestHead)) {
+                best = g;
+                bestDistance = distance;
+                bestHead = group->head;
             }
         }
-        
-        idx = (idx + 1) % MAX_THEN;
     }
     
-    uint64_t matchedThenId = 0;
-    if (potentialIdx != sendv_marked_idx_push && potentialIdxDistance < 4096) {
-        
-        uint64_t then_id = sendv_marked_then_id[potentialIdx];
-        sendv_marked_then_id_hash[potentialIdx] = 0;
-        
-        // advance the pop idx as far as it will go
-        while (sendv_marked_then_id_hash[sendv_marked_idx_pop] == 0 &&
-               sendv_marked_idx_push != sendv_marked_idx_pop) {
-            sendv_marked_idx_pop = (sendv_marked_idx_pop + 1) % MAX_THEN;
+    if (best == THEN_NONE) {
+        // The hash also folds in the address of the file name, so a mark on a
+        // line outside the window can still be near enough. Fall back to
+        // checking every outstanding mark, as rare as that is.
+        for (uint32_t i = s->oldest; i < s->mark_count; i++) {
+            then_mark_t* mark = &s->marks[i];
+            if (!mark->live) {
+                continue;
+            }
+            uint64_t hash = s->groups[mark->group].hash;
+            uint64_t distance = hash > callerHash ? hash - callerHash : callerHash - hash;
+            if (distance < bestDistance) {
+                best = mark->group;
+                bestDistance = distance;
+            }
         }
-        
-        matchedThenId = then_id;
-        
-        // fprintf(stderr, "MATCH_STACK: ID %llu IDX %llu HASH %llu\n", then_id, idx, callerHash );
     }
     
-    return matchedThenId;
+    if (best == THEN_NONE) {
+        return 0;
+    }
+    return then_claim(s, best);
 }
 
 void pony_sendv(pony_ctx_t* ctx, pony_actor_t* to, pony_msg_t* first, pony_msg_t* last)
@@ -321,6 +813,8 @@ void pony_sendv(pony_ctx_t* ctx, pony_actor_t* to, pony_msg_t* first, pony_msg_t
     {
         ponyint_sched_add(ctx, to);
     }
+    
+    actor_check_mailbox(ctx, to);
 }
 
 void pony_send_message(pony_ctx_t* ctx, pony_actor_t* to, void * argumentPtr, uint64_t then_id, void (*handleMessageFunc)(void * message))
@@ -341,6 +835,59 @@ void pony_complete_then_message(pony_ctx_t* ctx, pony_actor_t* to, void * argume
     pony_sendv(ctx, to, &m->msg, &m->msg);
 }
 
+void* pony_alloc_inline_msg(size_t payload_size)
+{
+    pony_msginline_t* m = (pony_msginline_t*)pony_alloc_msg(sizeof(pony_msginline_t) + payload_size, kMessageInline);
+    if (m == NULL) {
+        return NULL;
+    }
+    m->func = NULL;
+    return m + 1;
+}
+
+void pony_free_inline_msg(void* payload)
+{
+    pony_msginline_t* m = ((pony_msginline_t*)payload) - 1;
+    ponyint_pool_free_ptr(m);
+}
+
+void pony_send_inline_message(pony_ctx_t* ctx, pony_actor_t* to, void * payload, uint64_t then_id, void (*handleMessageFunc)(void * payload))
+{
+    sendv_last_then_id = then_id;
+    
+    pony_msginline_t* m = ((pony_msginline_t*)payload) - 1;
+    m->func = handleMessageFunc;
+    pony_sendv(ctx, to, &m->msg, &m->msg);
+}
+
+void pony_send_inline_batch(pony_ctx_t* ctx, pony_actor_t* to, void ** payloads, int count, void (*handleMessageFunc)(void * payload))
+{
+    if (count <= 0) {
+        return;
+    }
+    
+    sendv_last_then_id = 0;
+    
+    pony_msginline_t* first = ((pony_msginline_t*)payloads[0]) - 1;
+    pony_msginline_t* last = first;
+    first->func = handleMessageFunc;
+    
+    for (int i = 1; i < count; i++) {
+        pony_msginline_t* m = ((pony_msginline_t*)payloads[i]) - 1;
+        m->func = handleMessageFunc;
+        atomic_store_explicit(&last->msg.next, &m->msg, memory_order_relaxed);
+        last = m;
+    }
+    
+    // The push's release fence publishes the links above along with the rest.
+    if(ponyint_actor_messageq_push_batch(&to->queue, &first->msg, &last->msg, count))
+    {
+        ponyint_sched_add(ctx, to);
+    }
+    
+    actor_check_mailbox(ctx, to);
+}
+
 void pony_then_message(pony_ctx_t* ctx, pony_actor_t* to, uint64_t then_id)
 {
     sendv_last_then_id = then_id;
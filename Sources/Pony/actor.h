@@ -16,7 +16,7 @@ typedef struct pony_actor_t
 {
     messageq_t queue;
     PONY_ATOMIC(uint8_t) flags;
-    int32_t uid;
+    uint64_t uid;
     int32_t priority;
     int32_t coreAffinity;
     int32_t batchSize;
@@ -28,6 +28,24 @@ typedef struct pony_actor_t
     PONY_ATOMIC(bool) parked;
 
     bool destroy;
+
+    // Link for the scheduler's inject queues. Only meaningful while the actor
+    // is on one, and an actor is scheduled in at most one place at a time.
+    void* inject_next;
+
+    // Backpressure. An actor whose mailbox holds more than mailboxLimit
+    // messages mutes the actors sending to it: each parks, muted, on the
+    // receiver's muted_senders until the receiver drains to half its limit.
+    // Zero leaves the mailbox unbounded.
+    int32_t mailboxLimit;
+    PONY_ATOMIC(bool) muted;
+    struct pony_actor_t* mute_next;
+    PONY_ATOMIC(struct pony_actor_t*) muted_senders;
+
+    // The count at which this actor wakes the threads in
+    // ponyint_actors_wait(), or -1 if none is waiting on it. A waiter sets it
+    // from how far its actors' sum still has to fall.
+    PONY_ATOMIC(int32_t) wait_threshold;
 } pony_actor_t;
 
 enum
@@ -50,6 +68,9 @@ void ponyint_actor_setpriority(pony_actor_t* actor, int32_t priority);
 int32_t ponyint_actor_getbatchSize(pony_actor_t* actor);
 void ponyint_actor_setbatchSize(pony_actor_t* actor, int32_t batchSize);
 
+int32_t ponyint_actor_getmailboxLimit(pony_actor_t* actor);
+void ponyint_actor_setmailboxLimit(pony_actor_t* actor, int32_t mailboxLimit);
+
 int32_t ponyint_actor_getcoreAffinity(pony_actor_t* actor);
 void ponyint_actor_setcoreAffinity(pony_actor_t* actor, int32_t coreAffinity);
 
@@ -66,8 +87,19 @@ void ponyint_actor_setpendingdestroy(pony_actor_t* actor);
 
 size_t ponyint_actor_num_messages(pony_actor_t* actor);
 
+bool ponyint_actors_should_wait(int32_t min_msgs, pony_actor_t** actors, int num_actors);
+
+// Blocks until the actors hold no more than min_msgs messages between them.
+// The actors wake the caller as they drain rather than it polling them.
+void ponyint_actors_wait(int32_t min_msgs, pony_actor_t** actors, int num_actors);
+
 void pony_send_message(pony_ctx_t* ctx, pony_actor_t* to, void * argumentPtr, uint64_t then_id, void (*handleMessageFunc)(void * message));
 void pony_complete_then_message(pony_ctx_t* ctx, pony_actor_t* to, void * argumentPtr, void (*handleMessageFunc)(void * message));
 void pony_then_message(pony_ctx_t* ctx, pony_actor_t* to, uint64_t then_id);
 
+void* pony_alloc_inline_msg(size_t payload_size);
+void pony_free_inline_msg(void* payload);
+void pony_send_inline_message(pony_ctx_t* ctx, pony_actor_t* to, void * payload, uint64_t then_id, void (*handleMessageFunc)(void * payload));
+void pony_send_inline_batch(pony_ctx_t* ctx, pony_actor_t* to, void ** payloads, int count, void (*handleMessageFunc)(void * payload));
+
 #endif /* actor_h */
@@ -22,10 +22,33 @@ uint32_t ponyint_e_core_count();
 
 uint32_t ponyint_core_count(void);
 
+// The cpus' worth of time this process may actually use: the core count, less
+// whatever a cpuset or cgroup cpu quota takes away. Only Linux has the latter.
+uint32_t ponyint_cpu_budget(void);
+
 uint32_t ponyint_hybrid_cores_enabled();
 
 void ponyint_cpu_apply_thread_affinity(int coreAffinity);
 
+// How far apart two cpus are, as far as sharing a cache goes. Smaller is
+// closer. Platforms that cannot tell report every pair as PONY_CPU_DISTANCE_NODE.
+#define PONY_CPU_DISTANCE_SELF   0
+#define PONY_CPU_DISTANCE_SMT    1
+#define PONY_CPU_DISTANCE_LLC    2
+#define PONY_CPU_DISTANCE_NODE   3
+#define PONY_CPU_DISTANCE_REMOTE 4
+
+uint32_t ponyint_cpu_distance(int32_t cpu_a, int32_t cpu_b);
+
+// The cpu the nth scheduler of the given affinity is placed on, or -1 if the
+// platform does not expose topology. Cpus are handed out one per physical core,
+// grouped by node and last level cache, before any SMT sibling is used.
+int32_t ponyint_cpu_for_scheduler(int coreAffinity, uint32_t nth);
+
+// Pins the calling thread to exactly one cpu. A no-op unless
+// FLYNN_PIN_SCHEDULERS=1.
+void ponyint_cpu_pin_scheduler(int32_t cpu);
+
 void ponyint_cpu_sleep(int ns);
 
 static inline void ponyint_cpu_relax(void)
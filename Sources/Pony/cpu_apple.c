@@ -135,6 +135,11 @@ uint32_t ponyint_core_count()
     return hw_core_count;
 }
 
+uint32_t ponyint_cpu_budget()
+{
+    return hw_core_count;
+}
+
 uint32_t ponyint_hybrid_cores_enabled()
 {
     return hybrid_cpu_enabled;
@@ -145,6 +150,27 @@ void ponyint_cpu_apply_thread_affinity(int coreAffinity)
     (void)coreAffinity;
 }
 
+// Darwin exposes neither cache sharing nor a way to pin a thread to a cpu, so
+// every pair of cpus looks the same and steal order falls back to index order.
+uint32_t ponyint_cpu_distance(int32_t cpu_a, int32_t cpu_b)
+{
+    (void)cpu_a;
+    (void)cpu_b;
+    return PONY_CPU_DISTANCE_NODE;
+}
+
+int32_t ponyint_cpu_for_scheduler(int coreAffinity, uint32_t nth)
+{
+    (void)coreAffinity;
+    (void)nth;
+    return -1;
+}
+
+void ponyint_cpu_pin_scheduler(int32_t cpu)
+{
+    (void)cpu;
+}
+
 void ponyint_cpu_sleep(int ns)
 {
     usleep(ns);
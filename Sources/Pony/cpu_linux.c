@@ -408,6 +408,469 @@ static bool cpu_physical(uint32_t cpu)
     return true;
 }
 
+// ---------------------------------------------------------------------------
+// topology
+//
+// For every cpu we record three ids, each the lowest cpu of the group it
+// belongs to:
+//
+//   core  thread_siblings_list, so SMT siblings share it
+//   llc   shared_cpu_list of the highest level cache the cpu reports
+//   node  /sys/devices/system/node/nodeN/cpulist, or physical_package_id on
+//         kernels built without NUMA
+//
+// The scheduler uses them to steal from the nearest busy scheduler first. On a
+// multi-socket machine a steal from the other socket drags the actor's mailbox
+// and state across to our L3, and the actor is likely to be woken back on the
+// other side moments later.
+// ---------------------------------------------------------------------------
+
+static bool topo_known = false;
+static int16_t topo_core[CPU_SETSIZE];
+static int16_t topo_llc[CPU_SETSIZE];
+static int16_t topo_node[CPU_SETSIZE];
+static uint8_t topo_smt_rank[CPU_SETSIZE];
+
+// The cpus we are allowed to run on, in the order schedulers are placed on them.
+static int16_t topo_order[CPU_SETSIZE];
+static uint32_t topo_order_count = 0;
+
+// One scheduler per cpu is opt-in (FLYNN_PIN_SCHEDULERS=1). See
+// ponyint_cpu_pin_scheduler().
+static bool hw_pin_schedulers = false;
+
+static int16_t cpu_list_first(const char* path, int16_t fallback)
+{
+    cpu_set_t set;
+    if(!cpu_read_list_file(path, &set))
+        return fallback;
+
+    for(int i = 0; i < CPU_SETSIZE; i++)
+    {
+        if(CPU_ISSET(i, &set))
+            return (int16_t)i;
+    }
+    return fallback;
+}
+
+static int16_t cpu_llc_of(uint32_t cpu)
+{
+    int16_t llc = (int16_t)cpu;
+    uint64_t best_level = 0;
+
+    for(int idx = 0; idx < 16; idx++)
+    {
+        char path[FILENAME_MAX];
+        uint64_t level = 0;
+
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%u/cache/index%d/level", cpu, idx);
+        if(!cpu_read_u64(path, &level))
+            break;
+        if(level <= best_level)
+            continue;
+
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%u/cache/index%d/shared_cpu_list", cpu, idx);
+        llc = cpu_list_first(path, llc);
+        best_level = level;
+    }
+
+    return llc;
+}
+
+static int topo_compare(const void* a, const void* b)
+{
+    int x = *(const int16_t*)a;
+    int y = *(const int16_t*)b;
+
+    // Every physical core gets a scheduler before any core gets a second one,
+    // and within that schedulers fill a node, then an LLC, before moving on.
+    if(topo_smt_rank[x] != topo_smt_rank[y])
+        return topo_smt_rank[x] - topo_smt_rank[y];
+    if(topo_node[x] != topo_node[y])
+        return topo_node[x] - topo_node[y];
+    if(topo_llc[x] != topo_llc[y])
+        return topo_llc[x] - topo_llc[y];
+    if(topo_core[x] != topo_core[y])
+        return topo_core[x] - topo_core[y];
+    return x - y;
+}
+
+static void cpu_detect_topology()
+{
+    uint32_t ncpus = cpu_present_count();
+
+    for(uint32_t i = 0; i < ncpus; i++)
+    {
+        char path[FILENAME_MAX];
+        uint64_t package = 0;
+
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list", i);
+        topo_core[i] = cpu_list_first(path, (int16_t)i);
+        topo_llc[i] = cpu_llc_of(i);
+
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%u/topology/physical_package_id", i);
+        topo_node[i] = cpu_read_u64(path, &package) ? (int16_t)package : 0;
+    }
+
+    cpu_set_t nodes;
+    if(cpu_read_list_file("/sys/devices/system/node/online", &nodes))
+    {
+        for(int n = 0; n < CPU_SETSIZE; n++)
+        {
+            if(!CPU_ISSET(n, &nodes))
+                continue;
+
+            char path[FILENAME_MAX];
+            cpu_set_t members;
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+            if(!cpu_read_list_file(path, &members))
+                continue;
+
+            for(uint32_t i = 0; i < ncpus; i++)
+            {
+                if(CPU_ISSET(i, &members))
+                    topo_node[i] = (int16_t)n;
+            }
+        }
+    }
+
+    cpu_set_t allowed;
+    if(sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0)
+        return;
+
+    cpu_set_t cores_seen;
+    CPU_ZERO(&cores_seen);
+    topo_order_count = 0;
+
+    for(uint32_t i = 0; i < ncpus; i++)
+    {
+        if(!CPU_ISSET(i, &allowed))
+            continue;
+
+        // Rank against the allowed set, not the machine: if a cpuset leaves us
+        // only the second thread of a core, that thread is the core.
+        topo_smt_rank[i] = CPU_ISSET(topo_core[i], &cores_seen) ? 1 : 0;
+        CPU_SET(topo_core[i], &cores_seen);
+        topo_order[topo_order_count++] = (int16_t)i;
+    }
+
+    if(topo_order_count == 0)
+        return;
+
+    qsort(topo_order, topo_order_count, sizeof(int16_t), topo_compare);
+    topo_known = true;
+
+    const char * pin = getenv("FLYNN_PIN_SCHEDULERS");
+    hw_pin_schedulers = (pin != NULL && pin[0] == '1');
+    if(hw_pin_schedulers)
+        pony_syslog2("Flynn", "schedulers will be pinned one per cpu (FLYNN_PIN_SCHEDULERS)\n");
+}
+
+uint32_t ponyint_cpu_distance(int32_t cpu_a, int32_t cpu_b)
+{
+    if(!topo_known || cpu_a < 0 || cpu_b < 0 ||
+       cpu_a >= CPU_SETSIZE || cpu_b >= CPU_SETSIZE)
+        return PONY_CPU_DISTANCE_NODE;
+
+    if(cpu_a == cpu_b)
+        return PONY_CPU_DISTANCE_SELF;
+    if(topo_core[cpu_a] == topo_core[cpu_b])
+        return PONY_CPU_DISTANCE_SMT;
+    if(topo_llc[cpu_a] == topo_llc[cpu_b])
+        return PONY_CPU_DISTANCE_LLC;
+    if(topo_node[cpu_a] == topo_node[cpu_b])
+        return PONY_CPU_DISTANCE_NODE;
+    return PONY_CPU_DISTANCE_REMOTE;
+}
+
+int32_t ponyint_cpu_for_scheduler(int coreAffinity, uint32_t nth)
+{
+    if(!topo_known)
+        return -1;
+
+    // With hybrid detection off the E/P split is nominal, and the caller passes
+    // kCoreAffinity_None and counts every scheduler.
+    const cpu_set_t* class = NULL;
+    if(hybrid_cpu_enabled != 0 && coreAffinity == kCoreAffinity_OnlyEfficiency)
+        class = &hw_e_cpus;
+    else if(hybrid_cpu_enabled != 0 && coreAffinity == kCoreAffinity_OnlyPerformance)
+        class = &hw_p_cpus;
+
+    uint32_t eligible = 0;
+    for(uint32_t i = 0; i < topo_order_count; i++)
+    {
+        if(class == NULL || CPU_ISSET(topo_order[i], class))
+            eligible++;
+    }
+
+    // A cpuset that excluded the whole class; better somewhere than nowhere.
+    if(eligible == 0)
+    {
+        class = NULL;
+        eligible = topo_order_count;
+    }
+
+    // More schedulers than cpus wraps around and doubles up.
+    uint32_t want = nth % eligible;
+    for(uint32_t i = 0; i < topo_order_count; i++)
+    {
+        if(class != NULL && !CPU_ISSET(topo_order[i], class))
+            continue;
+        if(want == 0)
+            return topo_order[i];
+        want--;
+    }
+
+    return -1;
+}
+
+void ponyint_cpu_pin_scheduler(int32_t cpu)
+{
+    if(!hw_pin_schedulers || cpu < 0 || cpu >= CPU_SETSIZE)
+        return;
+
+    cpu_set_t target;
+    CPU_ZERO(&target);
+    CPU_SET(cpu, &target);
+
+    // Overrides any class-wide pin from FLYNN_PIN_CORES, which is a superset.
+    if(sched_setaffinity(0, sizeof(cpu_set_t), &target) != 0)
+        pony_syslog2("Flynn", "failed to pin scheduler to cpu %d: %s\n", cpu, strerror(errno));
+}
+
+// ---------------------------------------------------------------------------
+// CPU budget
+//
+// How many cpus' worth of time we may actually use, which in a container is
+// often far less than the cpus we can see. Three things limit it:
+//
+//   1. sched_getaffinity(), which already reflects any cpuset
+//   2. cpuset.cpus.effective (cgroup v2) or cpuset.effective_cpus (v1), for
+//      the odd case where the affinity mask has not been narrowed to match
+//   3. a CFS bandwidth quota: cpu.max (v2) or cpu.cfs_quota_us over
+//      cpu.cfs_period_us (v1), rounded up to whole cpus
+//
+// Quotas nest, so every cgroup from ours up to the root of the mount is
+// checked and the tightest wins. Running more schedulers than the quota allows
+// only gets the whole process throttled at the end of every period.
+// ---------------------------------------------------------------------------
+
+static uint32_t hw_cpu_budget = 0;
+
+// Finds where the cgroup controller (or the v2 unified hierarchy, when
+// controller is NULL) is mounted, and our cgroup's directory beneath it.
+static bool cgroup_dir(const char* controller, char* mount, size_t mount_len, char* dir, size_t dir_len)
+{
+    FILE* f = fopen("/proc/self/mountinfo", "re");
+    if(f == NULL)
+        return false;
+    
+    char line[1024];
+    char root[FILENAME_MAX];
+    bool found = false;
+    
+    while(!found && fgets(line, sizeof(line), f) != NULL)
+    {
+        // id parent major:minor root mount-point options [optional...] - type source super-options
+        char mnt_root[FILENAME_MAX];
+        char mnt_point[FILENAME_MAX];
+        if(sscanf(line, "%*s %*s %*s %4095s %4095s", mnt_root, mnt_point) != 2)
+            continue;
+        
+        char* sep = strstr(line, " - ");
+        if(sep == NULL)
+            continue;
+        
+        char fstype[64];
+        char super[512];
+        if(sscanf(sep + 3, "%63s %*s %511s", fstype, super) != 2)
+            continue;
+        
+        if(controller == NULL)
+        {
+            found = strcmp(fstype, "cgroup2") == 0;
+        }
+        else if(strcmp(fstype, "cgroup") == 0)
+        {
+            for(char* opt = strtok(super, ","); opt != NULL; opt = strtok(NULL, ","))
+            {
+                if(strcmp(opt, controller) == 0)
+                    found = true;
+            }
+        }
+        
+        if(found)
+        {
+            snprintf(mount, mount_len, "%s", mnt_point);
+            snprintf(root, sizeof(root), "%s", mnt_root);
+        }
+    }
+    fclose(f);
+    
+    if(!found)
+        return false;
+    
+    // Our path within that hierarchy: "0::/path" for v2, "N:a,b:/path" for v1.
+    f = fopen("/proc/self/cgroup", "re");
+    if(f == NULL)
+        return false;
+    
+    char path[FILENAME_MAX];
+    found = false;
+    while(!found && fgets(line, sizeof(line), f) != NULL)
+    {
+        char* controllers = strchr(line, ':');
+        char* cgroup = controllers ? strchr(controllers + 1, ':') : NULL;
+        if(cgroup == NULL)
+            continue;
+        *cgroup++ = '\0';
+        controllers++;
+        cgroup[strcspn(cgroup, "\n")] = '\0';
+        
+        if(controller == NULL)
+        {
+            found = (strncmp(line, "0", 1) == 0 && controllers[0] == '\0');
+        }
+        else
+        {
+            for(char* c = strtok(controllers, ","); c != NULL; c = strtok(NULL, ","))
+            {
+                if(strcmp(c, controller) == 0)
+                    found = true;
+            }
+        }
+        
+        if(found)
+            snprintf(path, sizeof(path), "%s", cgroup);
+    }
+    fclose(f);
+    
+    if(!found)
+        return false;
+    
+    // Inside a cgroup namespace the mount's root is our own cgroup, and the
+    // path is already relative to it.
+    size_t root_len = strlen(root);
+    const char* relative = path;
+    if(strcmp(root, "/") != 0 && strncmp(path, root, root_len) == 0)
+        relative = path + root_len;
+    
+    int n = snprintf(dir, dir_len, "%s%s", mount, strcmp(relative, "/") == 0 ? "" : relative);
+    return n > 0 && (size_t)n < dir_len;
+}
+
+// Builds dir/file into path. False, and the file should be skipped, if it does
+// not fit: a truncated path could name some other file entirely.
+static bool cgroup_file(char* path, size_t path_len, const char* dir, const char* file)
+{
+    int n = snprintf(path, path_len, "%s/%s", dir, file);
+    return n > 0 && (size_t)n < path_len;
+}
+
+// Tightest quota, in cpus rounded up, from dir up to mount. 0 if unlimited.
+static uint32_t cgroup_quota(const char* mount, char* dir, bool v2)
+{
+    uint32_t budget = 0;
+    size_t mount_len = strlen(mount);
+    
+    while(true)
+    {
+        char path[FILENAME_MAX];
+        uint64_t quota = 0;
+        uint64_t period = 0;
+        bool limited = false;
+        
+        if(v2)
+        {
+            char buf[64];
+            limited = cgroup_file(path, sizeof(path), dir, "cpu.max") &&
+                cpu_read_text(path, buf, sizeof(buf)) &&
+                strncmp(buf, "max", 3) != 0 &&
+                sscanf(buf, "%llu %llu", (unsigned long long*)&quota, (unsigned long long*)&period) == 2;
+        }
+        else
+        {
+            // cfs_quota_us is -1 when unlimited, which strtoull will not take.
+            char buf[64];
+            if(cgroup_file(path, sizeof(path), dir, "cpu.cfs_quota_us") &&
+               cpu_read_text(path, buf, sizeof(buf)) && buf[0] != '-')
+            {
+                quota = strtoull(buf, NULL, 10);
+                limited = cgroup_file(path, sizeof(path), dir, "cpu.cfs_period_us") &&
+                    cpu_read_u64(path, &period);
+            }
+        }
+        
+        if(limited && quota > 0 && period > 0)
+        {
+            uint32_t cpus = (uint32_t)((quota + period - 1) / period);
+            if(budget == 0 || cpus < budget)
+                budget = cpus;
+        }
+        
+        if(strlen(dir) <= mount_len)
+            break;
+        char* slash = strrchr(dir, '/');
+        if(slash == NULL || (size_t)(slash - dir) < mount_len)
+            break;
+        *slash = '\0';
+    }
+    
+    return budget;
+}
+
+static void cpu_detect_budget()
+{
+    char mount[FILENAME_MAX];
+    char dir[FILENAME_MAX];
+    char path[FILENAME_MAX];
+    
+    // hw_core_count already comes from sched_getaffinity(), give or take the
+    // platform corrections above.
+    uint32_t budget = hw_core_count;
+    const char* limited_by = "affinity";
+    
+    // On a hybrid host the v2 hierarchy is mounted too but holds no
+    // controllers, so a v1 mount of the controller takes precedence.
+    cpu_set_t cpuset;
+    bool have_cpuset = false;
+    if(cgroup_dir("cpuset", mount, sizeof(mount), dir, sizeof(dir)))
+    {
+        have_cpuset = cgroup_file(path, sizeof(path), dir, "cpuset.effective_cpus") &&
+            cpu_read_list_file(path, &cpuset);
+    }
+    else if(cgroup_dir(NULL, mount, sizeof(mount), dir, sizeof(dir)))
+    {
+        have_cpuset = cgroup_file(path, sizeof(path), dir, "cpuset.cpus.effective") &&
+            cpu_read_list_file(path, &cpuset);
+    }
+    if(have_cpuset && (uint32_t)CPU_COUNT(&cpuset) < budget)
+    {
+        budget = (uint32_t)CPU_COUNT(&cpuset);
+        limited_by = "cpuset";
+    }
+    
+    uint32_t quota = 0;
+    if(cgroup_dir("cpu", mount, sizeof(mount), dir, sizeof(dir)))
+        quota = cgroup_quota(mount, dir, false);
+    else if(cgroup_dir(NULL, mount, sizeof(mount), dir, sizeof(dir)))
+        quota = cgroup_quota(mount, dir, true);
+    if(quota > 0 && quota < budget)
+    {
+        budget = quota;
+        limited_by = "cpu quota";
+    }
+    
+    hw_cpu_budget = budget > 0 ? budget : 1;
+    
+    if(hw_cpu_budget < hw_core_count)
+        pony_syslog2("Flynn", "cpu budget is %u of %u cpus, limited by %s\n", hw_cpu_budget, hw_core_count, limited_by);
+}
+
 void ponyint_cpu_init()
 {
     cpu_set_t all_cpus;
@@ -476,6 +939,9 @@ void ponyint_cpu_init()
     if (hw_p_core_count == 0) {
         hw_p_core_count = 1;
     }
+
+    cpu_detect_topology();
+    cpu_detect_budget();
 }
 
 uint32_t ponyint_p_core_count()
@@ -493,6 +959,11 @@ uint32_t ponyint_core_count()
     return hw_core_count;
 }
 
+uint32_t ponyint_cpu_budget()
+{
+    return hw_cpu_budget;
+}
+
 uint32_t ponyint_hybrid_cores_enabled()
 {
     return hybrid_cpu_enabled;
@@ -58,6 +58,11 @@ uint32_t ponyint_core_count()
     return hw_core_count;
 }
 
+uint32_t ponyint_cpu_budget()
+{
+    return hw_core_count;
+}
+
 uint32_t ponyint_hybrid_cores_enabled()
 {
     return hybrid_cpu_enabled;
@@ -68,6 +73,25 @@ void ponyint_cpu_apply_thread_affinity(int coreAffinity)
     (void)coreAffinity;
 }
 
+uint32_t ponyint_cpu_distance(int32_t cpu_a, int32_t cpu_b)
+{
+    (void)cpu_a;
+    (void)cpu_b;
+    return PONY_CPU_DISTANCE_NODE;
+}
+
+int32_t ponyint_cpu_for_scheduler(int coreAffinity, uint32_t nth)
+{
+    (void)coreAffinity;
+    (void)nth;
+    return -1;
+}
+
+void ponyint_cpu_pin_scheduler(int32_t cpu)
+{
+    (void)cpu;
+}
+
 void ponyint_cpu_sleep(int ns)
 {
     pony_usleep(ns);
@@ -80,8 +104,19 @@ void ponyint_cpu_yield()
 
 uint64_t ponyint_cpu_tick()
 {
-    // TODO: linux
-    return 0;
+    // Nanoseconds, like the other platforms; the scheduler's idle policy
+    // measures spins and suspensions against it.
+    static LARGE_INTEGER freq = { 0 };
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+    
+    LARGE_INTEGER count;
+    QueryPerformanceCounter(&count);
+    
+    uint64_t ticks = (uint64_t)count.QuadPart;
+    uint64_t hz = (uint64_t)freq.QuadPart;
+    return (ticks / hz) * 1000000000ULL + (ticks % hz) * 1000000000ULL / hz;
 }
 
 #endif
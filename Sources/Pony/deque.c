@@ -0,0 +1,106 @@
+// Note: This code is derivative of the Pony runtime; see README.md for more details
+
+#include "platform.h"
+
+#define PONY_WANT_ATOMIC_DEFS
+
+#include "deque.h"
+#include "memory.h"
+#include <stdio.h>
+
+// This is the C11 formulation of the Chase-Lev deque from "Correct and
+// Efficient Work-Stealing for Weak Memory Models" (Le, Pop, Cohen, Zappa
+// Nardelli, PPoPP 2013), minus the resizing: a scheduler's run queue is bounded
+// and overflow is the caller's problem. The owner's pop takes from the top
+// rather than the bottom, which makes the queue FIFO for everyone.
+
+void ponyint_deque_init(deque_t* q)
+{
+    q->buffer = ponyint_pool_alloc(PONY_DEQUE_SIZE * sizeof(void*));
+    q->mask = PONY_DEQUE_SIZE - 1;
+
+    for(int64_t i = 0; i < PONY_DEQUE_SIZE; i++)
+        atomic_store_explicit(&q->buffer[i], NULL, memory_order_relaxed);
+
+    atomic_store_explicit(&q->top, 0, memory_order_relaxed);
+    atomic_store_explicit(&q->bottom, 0, memory_order_relaxed);
+}
+
+void ponyint_deque_destroy(deque_t* q)
+{
+    ponyint_pool_free(q->buffer, PONY_DEQUE_SIZE * sizeof(void*));
+    q->buffer = NULL;
+    atomic_store_explicit(&q->top, 0, memory_order_relaxed);
+    atomic_store_explicit(&q->bottom, 0, memory_order_relaxed);
+}
+
+bool ponyint_deque_push(deque_t* q, void* data)
+{
+    int64_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+
+    // Our view of top can only be stale in the direction of it being too
+    // small, so this errs on the side of reporting full.
+    if(b - t > q->mask)
+        return false;
+
+    atomic_store_explicit(&q->buffer[b & q->mask], data, memory_order_relaxed);
+
+    // Publish the slot before the new bottom. A thief that sees the new bottom
+    // must also see the data.
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+    return true;
+}
+
+void* ponyint_deque_pop(deque_t* q)
+{
+    // The owner takes from the top, the same as a thief, so that an actor put
+    // back after its batch goes behind everything already queued rather than
+    // straight back in front of it. Unlike a thief it does not give up when it
+    // loses the CAS: it knows there is work, and NULL would send it off to
+    // spin.
+    while(true)
+    {
+        int64_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+        int64_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+
+        if(t >= b)
+            return NULL;
+
+        void* data = atomic_load_explicit(&q->buffer[t & q->mask], memory_order_relaxed);
+
+        if(atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+                                                   memory_order_seq_cst, memory_order_relaxed))
+            return data;
+    }
+}
+
+void* ponyint_deque_steal(deque_t* q)
+{
+    int64_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+
+    if(t >= b)
+        return NULL;
+
+    void* data = atomic_load_explicit(&q->buffer[t & q->mask], memory_order_relaxed);
+
+    // Losing the CAS means the owner or another thief got there first. We
+    // report that the same as empty; the caller will come back around.
+    if(!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+                                                memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+
+    return data;
+}
+
+int64_t ponyint_deque_num_messages(deque_t* q)
+{
+    // Approximate when read from another thread, which is all anyone needs it
+    // for: choosing a victim and deciding whether to park.
+    int64_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&q->top, memory_order_relaxed);
+    return (b > t) ? (b - t) : 0;
+}
@@ -0,0 +1,51 @@
+// Note: This code is derivative of the Pony runtime; see README.md for more details
+
+#include "platform.h"
+
+#ifndef deque_h
+#define deque_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include "atomics.h"
+
+// Capacity of a scheduler's run queue. Must be a power of two. A push that
+// finds the deque full fails, and the caller is expected to fall back to a
+// global queue; nothing is ever dropped.
+#define PONY_DEQUE_SIZE 8192
+
+/** Bounded Chase-Lev work stealing deque.
+ *
+ * Exactly one thread, the owner, may call ponyint_deque_push() and
+ * ponyint_deque_pop(). Any thread may call ponyint_deque_steal().
+ *
+ * The owner pushes at the bottom without an atomic RMW. Everyone, the owner
+ * included, takes from the top with a CAS, so actors run in the order they
+ * were queued: a scheduler that keeps putting back the actor it just ran
+ * cannot keep the rest of its queue waiting. top and bottom live on separate
+ * lines so that a thief polling an empty deque does not keep pulling the
+ * owner's line away from it.
+ */
+typedef struct deque_t
+{
+    alignas(64) PONY_ATOMIC(int64_t) top;
+    alignas(64) PONY_ATOMIC(int64_t) bottom;
+    PONY_ATOMIC(void*)* buffer;
+    int64_t mask;
+} deque_t;
+
+void ponyint_deque_init(deque_t* q);
+
+void ponyint_deque_destroy(deque_t* q);
+
+bool ponyint_deque_push(deque_t* q, void* data);
+
+void* ponyint_deque_pop(deque_t* q);
+
+void* ponyint_deque_steal(deque_t* q);
+
+int64_t ponyint_deque_num_messages(deque_t* q);
+
+#endif /* deque_h */
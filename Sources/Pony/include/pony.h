@@ -65,7 +65,13 @@ void pony_node_destroy_actor_to_root(int socketfd);
 
 uint64_t pony_actor_new_then_id();
 
-bool pony_startup(int scheduler_count, int min_scheduler_count);
+// Schedulers beyond min_active_scheduler_count suspend themselves, highest
+// first, after finding no work for suspend_after_ms, and are revived when a
+// busy scheduler's queue reaches revive_backlog actors with none parked.
+// Passing 0 for min_active_scheduler_count keeps every scheduler active; 0 for
+// either threshold uses the default.
+bool pony_startup(int scheduler_count, int min_scheduler_count,
+                  int min_active_scheduler_count, int suspend_after_ms, int revive_backlog);
 void pony_shutdown(bool waitForRemotes);
 
 int pony_core_count();
@@ -74,6 +80,20 @@ int pony_p_core_count();
 bool pony_core_affinity_enabled();
 
 void * pony_actor_create();
+uint64_t pony_actor_uid(void * actor);
+
+// A reference to an actor that can be claimed for destruction by one thread
+// while others are still using it. acquire() returns the actor, or NULL once it
+// has been claimed, and must be paired with release(). claim() returns the
+// actor to exactly one caller, after every outstanding acquire() is released.
+// None of them take a lock.
+typedef struct pony_actor_ref_t pony_actor_ref_t;
+
+pony_actor_ref_t * pony_actor_ref_create(void * actor);
+void * pony_actor_ref_acquire(pony_actor_ref_t * ref);
+void pony_actor_ref_release(pony_actor_ref_t * ref);
+void * pony_actor_ref_claim(pony_actor_ref_t * ref);
+void pony_actor_ref_free(pony_actor_ref_t * ref);
 
 void pony_actor_mark_then_id(const void *  file, uint64_t line, uint64_t column);
 uint64_t pony_actor_get_then_id(const void * file, uint64_t line, uint64_t column);
@@ -82,12 +102,36 @@ void pony_actor_send_message(void * actor, void * argumentPtr, uint64_t then_id,
 void pony_actor_complete_then_message(void * actor, void * argumentPtr, void (*handleMessageFunc)(void * message));
 void pony_actor_then_message(void * actor, uint64_t then_id);
 
+// Sends a behaviour whose argument lives inside the message itself. Allocate
+// the message, write the argument into the returned payload, then send it; the
+// handler is given the payload and must consume it, as the runtime frees the
+// message once the handler returns. Allocation returns NULL if the pool cannot
+// get the memory, in which case there is nothing to send.
+void * pony_actor_alloc_inline_message(size_t payloadSize);
+void pony_actor_send_inline_message(void * actor, void * payload, uint64_t then_id, void (*handleMessageFunc)(void * payload));
+
+// Sends count inline messages to one actor with a single enqueue and at most
+// one wake up. They run in the order given and carry no then id, so a batch
+// cannot be followed by a do().
+void pony_actor_send_batch(void * actor, void ** payloads, int count, void (*handleMessageFunc)(void * payload));
+
+// Runnable actors are queued by the sign of their priority: those above 0 run
+// ahead of every actor at 0, which run ahead of every actor below it. Lower
+// priorities still get a small share of each scheduler, so they are never
+// starved outright.
 void pony_actor_setpriority(void * actor, int priority);
 int pony_actor_getpriority(void * actor);
 
 void pony_actor_setbatchSize(void * actor, int batchSize);
 int pony_actor_getbatchSize(void * actor);
 
+// Bounds an actor's mailbox. An actor that sends to it while it holds more
+// than mailboxLimit messages is muted, and not run again until the mailbox
+// drains to half the limit. Sends from threads that are not running an actor
+// are never held back. Zero, the default, leaves the mailbox unbounded.
+void pony_actor_setmailboxLimit(void * actor, int mailboxLimit);
+int pony_actor_getmailboxLimit(void * actor);
+
 void pony_actor_setcoreAffinity(void * actor, int coreAffinity);
 int pony_actor_getcoreAffinity(void * actor);
 
@@ -97,6 +141,23 @@ void pony_profiler_reset(void);
 int pony_profiler_max_types(void);
 int pony_profiler_collect(uint64_t * outNs, uint64_t * outCount, int maxTypes);
 
+typedef struct pony_scheduler_stats_t
+{
+    uint64_t steals;          // visits to a victim that took at least one actor
+    uint64_t stolen_actors;   // actors moved by those visits
+    uint64_t largest_steal;   // most actors moved by a single visit
+    uint64_t spin_hits;       // idle periods ended by work found while spinning
+    uint64_t parks;           // idle periods that gave up spinning and parked
+    uint64_t idle_gap_ns;     // running average of how long idle periods last
+    uint64_t spin_ns;         // how long the scheduler now spins before parking
+} pony_scheduler_stats_t;
+
+int pony_scheduler_count(void);
+int pony_active_scheduler_count(void);
+int pony_steal_batch_max(void);
+int pony_spin_max_us(void);
+int pony_scheduler_stats(pony_scheduler_stats_t * outStats, int maxSchedulers);
+
 void pony_actor_yield(void * actor);
 void pony_actor_suspend(void * actor);
 void pony_actor_resume(void * actor);
@@ -107,6 +168,9 @@ void pony_actor_destroy(void * actor);
 
 int pony_actors_load_balance(void * actorArray, int num_actors);
 
+// Block the calling thread until the actors hold no more than min_msgs
+// messages between them. The waiting thread sleeps until one of the actors
+// drains far enough to wake it, rather than polling.
 bool pony_actors_should_wait(int min_msgs, void * actorArray, int num_actors);
 void pony_actors_wait(int min_msgs, void * actor, int num_actors);
 void pony_actor_wait(int min_msgs, void * actor);
@@ -115,6 +179,21 @@ unsigned long pony_max_memory();
 unsigned long pony_current_memory();
 unsigned long pony_mapped_memory();
 
+typedef struct pony_pool_stats_t
+{
+    uint64_t thread;          // which thread, numbered in the order they first used the pool
+    uint64_t size;            // the size class, in bytes
+    uint64_t hits;            // allocations served from the thread's magazines
+    uint64_t depot_takes;     // full magazines taken from the shared depot
+    uint64_t slab_carves;     // allocations that had to carve new memory from a slab
+    uint64_t frees;           // objects freed by the thread
+    uint64_t depot_puts;      // full magazines handed to the depot on overflow
+    uint64_t held;            // objects in the thread's magazines right now
+} pony_pool_stats_t;
+
+int pony_pool_class_count(void);
+int pony_pool_stats(pony_pool_stats_t * outStats, int maxStats);
+
 void pony_set_thread_name(const char * name);
 void pony_syslog(const char * tag, const char * msg);
 char * pony_dns_resolve_cname(const char * domain);
@@ -2,21 +2,31 @@
 
 #include "platform.h"
 
+#define PONY_WANT_ATOMIC_DEFS
+
+#include "pony.h"
 #include "ponyrt.h"
 #include "threads.h"
+#include "cpu.h"
+#include "pagemap.h"
 
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #ifdef PLATFORM_IS_WINDOWS
-
+#include <malloc.h>
 #else
-//#include <sys/mman.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #endif
 
+#ifdef PLATFORM_IS_LINUX
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #ifdef PLATFORM_IS_APPLE
 #include <mach/vm_statistics.h>
 #endif
@@ -34,6 +44,7 @@ static size_t max_memory_allocated = 0;
 static PONY_ATOMIC(int64_t) unsafe_pony_mapped_memory = 0;
 size_t getPeakRSS();
 size_t getCurrentRSS();
+static void pool_depot_trim();
 
 void ponyint_update_memory_usage() {
     #ifdef PLATFORM_IS_WINDOWS
@@ -48,8 +59,9 @@ void ponyint_update_memory_usage() {
     if (now.tv_sec - previous.tv_sec >= 1) {
         total_memory_allocated = getCurrentRSS();
         max_memory_allocated = getPeakRSS();
+        pool_depot_trim();
+        previous = now;
     }
-    previous = now;
     #endif
 }
 
@@ -69,7 +81,50 @@ size_t ponyint_usafe_mapped_memory()
 }
 
 
+// ******** Size classes ********
+//
+// 16 byte spacing up to 128, then four classes to every doubling up to 4096,
+// so no pool allocation wastes more than 20% to rounding. Larger allocations
+// go to malloc() with a small header recording their size.
+
+#define PONY_POOL_CLASSES 28
+#define PONY_POOL_MAX_SIZE 4096
+#define PONY_POOL_MAX_NODES 8
+
+static const size_t pool_sizes[PONY_POOL_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+    640, 768, 896, 1024,
+    1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096
+};
+
+static int32_t ponyint_pool_index(size_t size) {
+    if (size <= 128) {
+        return (size == 0) ? 0 : (int32_t)((size + 15) >> 4) - 1;
+    }
+    if (size > PONY_POOL_MAX_SIZE) {
+        return -1;
+    }
+    
+    // Which doubling above 128 the size falls in, then which quarter of it.
+    size_t s = size - 1;
+    int32_t log2 = (int32_t)(sizeof(unsigned long) * 8 - 1) - __builtin_clzl((unsigned long)s);
+    size_t base = (size_t)1 << log2;
+    return 8 + (log2 - 7) * 4 + (int32_t)((s - base) / (base >> 2));
+}
+
 // ******** Thread-local reusable memory allocation pools ********
+//
+// Each thread keeps, per size class, a loaded magazine it allocates from and
+// frees to, and at most one spare. A free that finds both full hands the spare
+// to the global depot; an allocation that finds both empty takes a full one
+// from the depot, and only after that carves a new object from a slab.
+//
+// Messages are allocated by the sender and freed by the receiver, so this is
+// also what carries memory from the schedulers that consume messages back to
+// the threads that produce them.
 
 typedef struct pool_item_t {
     struct pool_item_t* next;
@@ -78,60 +133,853 @@ typedef struct pool_item_t {
 typedef struct pool_local_t {
     pool_item_t* pool;
     size_t length;
+    pool_item_t* spare;
+    size_t spare_length;
 } pool_local_t;
 
-static __pony_thread_local pool_local_t pool_local[12] = {0};
+static __pony_thread_local pool_local_t pool_local[PONY_POOL_CLASSES] = {0};
 
-static int32_t ponyint_pool_index(size_t size) {
-    if (size <= 32) { return 0; }
-    if (size <= 128) { return 1; }
-    if (size <= 256) { return 2; }
-    if (size <= 512) { return 3; }
-    if (size <= 2048) { return 4; }
-    if (size <= 4096) { return 5; }
-    return -1;
-}
-
-static size_t ponyint_alloc_size(size_t size) {
-    if (size <= 32) { return 32; }
-    if (size <= 128) { return 128; }
-    if (size <= 256) { return 256; }
-    if (size <= 512) { return 512; }
-    if (size <= 2048) { return 2048; }
-    if (size <= 4096) { return 4096; }
-    return size;
-}
-
-static void* pool_pop(size_t size) {
-    int32_t pool_index = ponyint_pool_index(size);
-    if (pool_index < 0) {
+// Items per magazine. FLYNN_POOL_MAGAZINE overrides it.
+#define PONY_POOL_MAGAZINE 64
+#define PONY_POOL_MAGAZINE_MIN 8
+#define PONY_POOL_MAGAZINE_MAX 4096
+
+// Bytes of each size class the depot may hold; the trimmer releases anything
+// past it as well as whatever sat unused. FLYNN_POOL_DEPOT_MB overrides it.
+#define PONY_POOL_DEPOT_BYTES (8 * 1024 * 1024)
+
+// ******** Configuration ********
+
+typedef struct pool_config_t {
+    bool numa;
+    bool huge;
+    size_t magazine;
+    int64_t depot_max[PONY_POOL_CLASSES];   // in magazines
+} pool_config_t;
+
+static pool_config_t pool_cfg;
+static PONY_ATOMIC(int) pool_cfg_state = 0;
+
+// Read once, on the first allocation, before any pool pointer exists, so that
+// every pointer the pool ever sees came from the same mode.
+static const pool_config_t* pool_config() {
+    if (atomic_load_explicit(&pool_cfg_state, memory_order_acquire) == 2) {
+        return &pool_cfg;
+    }
+    
+    int expected = 0;
+    if (!atomic_compare_exchange_strong_explicit(&pool_cfg_state, &expected, 1,
+                                                 memory_order_acquire, memory_order_acquire)) {
+        while (atomic_load_explicit(&pool_cfg_state, memory_order_acquire) != 2) { ; }
+        return &pool_cfg;
+    }
+    
+    pool_cfg.numa = false;
+#ifdef PLATFORM_IS_LINUX
+    const char * numa = getenv("FLYNN_NUMA_POOL");
+    pool_cfg.numa = (numa != NULL && numa[0] == '1');
+    if (pool_cfg.numa) {
+        pony_syslog2("Flynn", "NUMA local memory pools enabled (FLYNN_NUMA_POOL)\n");
+    }
+#endif
+    
+    pool_cfg.huge = false;
+#if defined(PLATFORM_IS_LINUX) && defined(MADV_HUGEPAGE)
+    const char * huge = getenv("FLYNN_HUGE_POOL");
+    pool_cfg.huge = (huge != NULL && huge[0] == '1');
+    if (pool_cfg.huge) {
+        pony_syslog2("Flynn", "huge page backed memory pools enabled (FLYNN_HUGE_POOL)\n");
+    }
+#endif
+    
+    pool_cfg.magazine = PONY_POOL_MAGAZINE;
+    const char * magazine = getenv("FLYNN_POOL_MAGAZINE");
+    if (magazine != NULL) {
+        long requested = strtol(magazine, NULL, 10);
+        if (requested < PONY_POOL_MAGAZINE_MIN) {
+            requested = PONY_POOL_MAGAZINE_MIN;
+        }
+        if (requested > PONY_POOL_MAGAZINE_MAX) {
+            requested = PONY_POOL_MAGAZINE_MAX;
+        }
+        pool_cfg.magazine = (size_t)requested;
+        pony_syslog2("Flynn", "pool magazine size set to %ld by FLYNN_POOL_MAGAZINE\n", requested);
+    }
+    
+    size_t depot_bytes = PONY_POOL_DEPOT_BYTES;
+    const char * depot = getenv("FLYNN_POOL_DEPOT_MB");
+    if (depot != NULL) {
+        long requested = strtol(depot, NULL, 10);
+        if (requested < 0) {
+            requested = 0;
+        }
+        depot_bytes = (size_t)requested * 1024 * 1024;
+        pony_syslog2("Flynn", "pool depot limit set to %ld MB per size class by FLYNN_POOL_DEPOT_MB\n", requested);
+    }
+    for (int32_t i = 0; i < PONY_POOL_CLASSES; i++) {
+        pool_cfg.depot_max[i] = (int64_t)(depot_bytes / (pool_cfg.magazine * pool_sizes[i]));
+    }
+    
+    atomic_store_explicit(&pool_cfg_state, 2, memory_order_release);
+    return &pool_cfg;
+}
+
+static inline bool pool_numa_enabled() {
+    return pool_config()->numa;
+}
+
+// ******** Slabs ********
+//
+// Every pool object is carved from a 64KB slab of a single size class. The
+// slab is aligned to its size and starts with its chunk_t, so a pointer whose
+// class is known finds its slab with a mask, and a pointer whose class is not
+// known finds it through the pagemap. Carving is a bump of a thread local
+// cursor; a thread never touches a slab's header once it has carved it out.
+//
+// With FLYNN_NUMA_POOL=1 (Linux) each slab is also bound to the allocating
+// thread's node, and a free on any other node is collected into a magazine
+// for that node's depot instead of our own.
+//
+// Slabs go back to the OS when the trimmer finds every object in one idle.
+//
+// With FLYNN_HUGE_POOL=1 (Linux) slabs are instead cut from 2MB regions the
+// kernel is asked to back with huge pages, so that a scheduler churning
+// through messages walks a handful of TLB entries rather than hundreds. See
+// the huge page regions below.
+
+#define PONY_POOL_SLAB_SIZE (64 * 1024)
+#define PONY_POOL_SLAB_HEADER 64
+
+struct chunk_t {
+    uint32_t node;
+    uint32_t pool_index;
+    uint32_t capacity;
+    
+    // Only touched by the trimmer, under pool_trim_lock.
+    uint32_t trimmed;
+    pool_item_t* trim_list;
+    struct chunk_t* trim_next;
+};
+
+typedef struct pool_carve_t {
+    char* next;
+    char* end;
+} pool_carve_t;
+
+static __pony_thread_local pool_carve_t pool_carve[PONY_POOL_CLASSES];
+
+// Frees bound for another node's depot, per (node, class).
+typedef struct pool_outbound_t {
+    pool_item_t* head;
+    size_t length;
+} pool_outbound_t;
+
+static __pony_thread_local pool_outbound_t pool_outbound[PONY_POOL_MAX_NODES][PONY_POOL_CLASSES];
+
+static __pony_thread_local int32_t pool_node = -1;
+static __pony_thread_local unsigned pool_node_real = 0;
+
+static int32_t pool_my_node() {
+    // Sampled once per thread. A scheduler pinned with FLYNN_PIN_SCHEDULERS
+    // never moves; one that is not might, and then keeps allocating for the
+    // node it started on, which is no worse than malloc() would do.
+    if (pool_node < 0) {
+        unsigned cpu = 0;
+        unsigned node = 0;
+#if defined(PLATFORM_IS_LINUX) && defined(SYS_getcpu)
+        if (pool_numa_enabled() && syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+            node = 0;
+        }
+#endif
+        (void)cpu;
+        pool_node_real = node;
+        pool_node = (int32_t)(node % PONY_POOL_MAX_NODES);
+    }
+    return pool_node;
+}
+
+static inline int32_t pool_depot_node() {
+    return pool_numa_enabled() ? pool_my_node() : 0;
+}
+
+static inline chunk_t* pool_chunk_of(void* p) {
+    return (chunk_t*)((uintptr_t)p & ~((uintptr_t)PONY_POOL_SLAB_SIZE - 1));
+}
+
+// size must be a power of two; the result is aligned to it.
+static void* pool_os_alloc(size_t size) {
+#ifdef PLATFORM_IS_WINDOWS
+    return _aligned_malloc(size, size);
+#else
+    // Over-map and trim to get the alignment the header lookup relies on.
+    size_t span = size * 2;
+    char* raw = (char*)mmap(NULL, span, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    
+    uintptr_t aligned = ((uintptr_t)raw + size - 1) & ~((uintptr_t)size - 1);
+    size_t head = aligned - (uintptr_t)raw;
+    size_t tail = span - head - size;
+    if (head > 0) {
+        munmap(raw, head);
+    }
+    if (tail > 0) {
+        munmap((char*)aligned + size, tail);
+    }
+    return (void*)aligned;
+#endif
+}
+
+static void pool_os_free(void* p, size_t size) {
+#ifdef PLATFORM_IS_WINDOWS
+    (void)size;
+    _aligned_free(p);
+#else
+    munmap(p, size);
+#endif
+}
+
+static void pool_os_bind(void* mem, size_t size) {
+#if defined(PLATFORM_IS_LINUX) && defined(SYS_mbind)
+    // MPOL_PREFERRED rather than MPOL_BIND: a full node should cost us a remote
+    // page, not an allocation failure. Without mbind (or without NUMA in the
+    // kernel) first touch by this thread gets the same result in practice.
+    if (pool_numa_enabled() && pool_node_real < sizeof(unsigned long) * 8) {
+        unsigned long mask = 1UL << pool_node_real;
+        syscall(SYS_mbind, mem, size, 1 /* MPOL_PREFERRED */,
+                &mask, sizeof(mask) * 8, 0);
+    }
+#else
+    (void)mem;
+    (void)size;
+#endif
+}
+
+// ******** Huge page regions (Linux, FLYNN_HUGE_POOL=1) ********
+//
+// Each node has one region being cut into slabs and a list of slabs the
+// trimmer found idle. A released slab goes on that list rather than back to
+// the OS: unmapping 64KB out of a huge page would only split it. Regions are
+// therefore never returned, and the mapped memory figure counts them whole.
+// The mode is for long running processes whose working set is stable.
+//
+// Slabs are taken once per 64KB of carving, so a spin lock is cheap enough.
+
+#define PONY_POOL_REGION_SIZE (2 * 1024 * 1024)
+
+typedef struct pool_region_t {
+    char* next;
+    char* end;
+    chunk_t* idle;
+} pool_region_t;
+
+static pool_region_t pool_regions[PONY_POOL_MAX_NODES];
+static PONY_ATOMIC(bool) pool_region_lock = false;
+
+static void* pool_region_slab(int32_t node) {
+    pool_region_t* region = &pool_regions[node];
+    void* mem = NULL;
+    
+    while (atomic_exchange_explicit(&pool_region_lock, true, memory_order_acquire)) {
+        while (atomic_load_explicit(&pool_region_lock, memory_order_relaxed)) { ; }
+    }
+    
+    if (region->idle != NULL) {
+        mem = region->idle;
+        region->idle = region->idle->trim_next;
+    } else {
+        if (region->next == region->end) {
+            char* fresh = (char*)pool_os_alloc(PONY_POOL_REGION_SIZE);
+            if (fresh != NULL) {
+#ifdef MADV_HUGEPAGE
+                // Advice only: with transparent huge pages disabled, or none to
+                // spare, this is an ordinary region of small pages.
+                madvise(fresh, PONY_POOL_REGION_SIZE, MADV_HUGEPAGE);
+#endif
+                pool_os_bind(fresh, PONY_POOL_REGION_SIZE);
+                region->next = fresh;
+                region->end = fresh + PONY_POOL_REGION_SIZE;
+                atomic_fetch_add_explicit(&unsafe_pony_mapped_memory, PONY_POOL_REGION_SIZE, memory_order_relaxed);
+            }
+        }
+        if (region->next != region->end) {
+            mem = region->next;
+            region->next += PONY_POOL_SLAB_SIZE;
+        }
+    }
+    
+    atomic_store_explicit(&pool_region_lock, false, memory_order_release);
+    return mem;
+}
+
+static void pool_region_release(chunk_t* chunk) {
+    pool_region_t* region = &pool_regions[chunk->node];
+    
+    while (atomic_exchange_explicit(&pool_region_lock, true, memory_order_acquire)) {
+        while (atomic_load_explicit(&pool_region_lock, memory_order_relaxed)) { ; }
+    }
+    
+    chunk->trim_next = region->idle;
+    region->idle = chunk;
+    
+    atomic_store_explicit(&pool_region_lock, false, memory_order_release);
+}
+
+// ******** Slab mapping ********
+
+static void* pool_slab_alloc(int32_t node) {
+    if (pool_config()->huge) {
+        return pool_region_slab(node);
+    }
+    
+    void* mem = pool_os_alloc(PONY_POOL_SLAB_SIZE);
+    if (mem != NULL) {
+        pool_os_bind(mem, PONY_POOL_SLAB_SIZE);
+        atomic_fetch_add_explicit(&unsafe_pony_mapped_memory, PONY_POOL_SLAB_SIZE, memory_order_relaxed);
+    }
+    return mem;
+}
+
+static void pool_slab_free(chunk_t* chunk) {
+    ponyint_pagemap_set(chunk, NULL);
+    
+    if (pool_config()->huge) {
+        pool_region_release(chunk);
+        return;
+    }
+    
+    pool_os_free(chunk, PONY_POOL_SLAB_SIZE);
+    atomic_fetch_sub_explicit(&unsafe_pony_mapped_memory, PONY_POOL_SLAB_SIZE, memory_order_relaxed);
+}
+
+static chunk_t* pool_slab_map(int32_t pool_index) {
+    int32_t node = pool_depot_node();
+    
+    void* mem = pool_slab_alloc(node);
+    if (mem == NULL) {
+        return NULL;
+    }
+    
+    chunk_t* chunk = (chunk_t*)mem;
+    chunk->node = (uint32_t)node;
+    chunk->pool_index = (uint32_t)pool_index;
+    chunk->capacity = (uint32_t)((PONY_POOL_SLAB_SIZE - PONY_POOL_SLAB_HEADER) / pool_sizes[pool_index]);
+    chunk->trimmed = 0;
+    chunk->trim_list = NULL;
+    chunk->trim_next = NULL;
+    
+    // A slab the pagemap cannot find would have its objects taken for large
+    // allocations by ponyint_pool_free_ptr(), so it is not used at all.
+    if (!ponyint_pagemap_set(chunk, chunk)) {
+        pool_slab_free(chunk);
+        return NULL;
+    }
+    return chunk;
+}
+
+static void* pool_slab_carve(int32_t pool_index) {
+    pool_carve_t* carve = &pool_carve[pool_index];
+    size_t size = pool_sizes[pool_index];
+    
+    if (carve->next == NULL || carve->next + size > carve->end) {
+        chunk_t* chunk = pool_slab_map(pool_index);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        carve->next = (char*)chunk + PONY_POOL_SLAB_HEADER;
+        carve->end = carve->next + (size_t)chunk->capacity * size;
+    }
+    
+    void* p = carve->next;
+    carve->next += size;
+    return p;
+}
+
+// ******** Magazine depot ********
+//
+// One per size class and per NUMA node; without the NUMA mode only node 0 is
+// used. A magazine is an ordinary freelist chain whose first item also carries
+// the link to the next magazine. That keeps it within the 16 byte class, at the
+// cost of counting a magazine's length when it is taken.
+//
+// Puts and takes are both lock free. The head carries a counter that every
+// successful CAS bumps, so a magazine taken and put back while a taker was
+// reading its link cannot fool that taker's CAS.
+//
+// A taker does read the link of a magazine that another thread may take first,
+// which is only safe as long as the magazine stays mapped. Trimming is the one
+// thing that unmaps magazines, so a trim first shuts the depot to new takers
+// and waits for those already inside to leave. A take that finds the depot
+// shut returns nothing rather than waiting; the caller carves instead.
+
+typedef struct pool_magazine_t {
+    pool_item_t item;
+    struct pool_magazine_t* next_magazine;
+} pool_magazine_t;
+
+PONY_ABA_PROTECTED_PTR_DECLARE(pool_magazine_t)
+
+typedef struct pool_depot_t {
+    alignas(64) PONY_ATOMIC_ABA_PROTECTED_PTR(pool_magazine_t) head;
+    PONY_ATOMIC(int64_t) magazines;
+    PONY_ATOMIC(int64_t) low_water;
+    alignas(64) PONY_ATOMIC(int32_t) takers;
+    PONY_ATOMIC(bool) trimming;
+} pool_depot_t;
+
+static pool_depot_t pool_depots[PONY_POOL_MAX_NODES][PONY_POOL_CLASSES];
+
+static void pool_depot_put(int32_t node, int32_t pool_index, pool_item_t* chain) {
+    pool_depot_t* depot = &pool_depots[node][pool_index];
+    pool_magazine_t* mag = (pool_magazine_t*)chain;
+    
+    PONY_ABA_PROTECTED_PTR(pool_magazine_t) cmp;
+    PONY_ABA_PROTECTED_PTR(pool_magazine_t) xchg;
+    // Load the head non-atomically. If object and counter are out of sync the
+    // CAS fails and hands us a consistent pair.
+    cmp.object = depot->head.object;
+    cmp.counter = depot->head.counter;
+    xchg.object = mag;
+    
+    do {
+        mag->next_magazine = cmp.object;
+        xchg.counter = cmp.counter + 1;
+    } while (!bigatomic_compare_exchange_weak_explicit(&depot->head, &cmp, xchg,
+                                                       memory_order_release, memory_order_relaxed));
+    atomic_fetch_add_explicit(&depot->magazines, 1, memory_order_relaxed);
+}
+
+// Takes the top magazine. Only safe while nothing can unmap a magazine under
+// us; see pool_depot_take().
+static pool_item_t* pool_depot_pop(pool_depot_t* depot) {
+    PONY_ABA_PROTECTED_PTR(pool_magazine_t) cmp;
+    PONY_ABA_PROTECTED_PTR(pool_magazine_t) xchg;
+    cmp.object = depot->head.object;
+    cmp.counter = depot->head.counter;
+    
+    pool_magazine_t* top;
+    do {
+        top = cmp.object;
+        if (top == NULL) {
+            return NULL;
+        }
+        atomic_thread_fence(memory_order_acquire);
+        xchg.object = top->next_magazine;
+        xchg.counter = cmp.counter + 1;
+    } while (!bigatomic_compare_exchange_weak_explicit(&depot->head, &cmp, xchg,
+                                                       memory_order_acquire, memory_order_relaxed));
+    
+    int64_t remaining = atomic_fetch_sub_explicit(&depot->magazines, 1, memory_order_relaxed) - 1;
+    if (remaining < atomic_load_explicit(&depot->low_water, memory_order_relaxed)) {
+        atomic_store_explicit(&depot->low_water, remaining, memory_order_relaxed);
+    }
+    
+    return &top->item;
+}
+
+static pool_item_t* pool_depot_take(int32_t node, int32_t pool_index) {
+    pool_depot_t* depot = &pool_depots[node][pool_index];
+    if (atomic_load_explicit(&depot->magazines, memory_order_relaxed) <= 0) {
         return NULL;
     }
     
+    // Pairs with pool_depot_shut(): either it sees us in here and waits for us,
+    // or we see the depot shut and stay out.
+    atomic_fetch_add_explicit(&depot->takers, 1, memory_order_seq_cst);
+    pool_item_t* mag = NULL;
+    if (!atomic_load_explicit(&depot->trimming, memory_order_seq_cst)) {
+        mag = pool_depot_pop(depot);
+    }
+    atomic_fetch_sub_explicit(&depot->takers, 1, memory_order_release);
+    
+    return mag;
+}
+
+// Keeps takers out of the depot until pool_depot_open(), waiting for any that
+// are already in to leave. Puts carry on as normal. Only the trim holds it.
+static void pool_depot_shut(pool_depot_t* depot) {
+    atomic_store_explicit(&depot->trimming, true, memory_order_seq_cst);
+    while (atomic_load_explicit(&depot->takers, memory_order_seq_cst) != 0) {
+        ponyint_cpu_relax();
+    }
+}
+
+static void pool_depot_open(pool_depot_t* depot) {
+    atomic_store_explicit(&depot->trimming, false, memory_order_release);
+}
+
+static size_t pool_chain_length(pool_item_t* p) {
+    size_t length = 0;
+    while (p != NULL) {
+        length++;
+        p = p->next;
+    }
+    return length;
+}
+
+// Puts a chain of any length back in the depot a magazine at a time.
+static void pool_depot_put_chain(int32_t node, int32_t pool_index, pool_item_t* chain) {
+    size_t magazine = pool_config()->magazine;
+    while (chain != NULL) {
+        pool_item_t* head = chain;
+        pool_item_t* tail = chain;
+        for (size_t n = 1; n < magazine && tail->next != NULL; n++) {
+            tail = tail->next;
+        }
+        chain = tail->next;
+        tail->next = NULL;
+        pool_depot_put(node, pool_index, head);
+    }
+}
+
+// ******** Trimming ********
+
+static PONY_ATOMIC(bool) pool_trim_lock = false;
+
+// Takes a chain of idle items, unmaps every slab whose objects are all in it,
+// and puts the rest back in the depot.
+static void pool_reclaim(int32_t node, int32_t pool_index, pool_item_t* chain) {
+    chunk_t* touched = NULL;
+    while (chain != NULL) {
+        pool_item_t* next = chain->next;
+        chunk_t* chunk = pool_chunk_of(chain);
+        if (chunk->trimmed == 0) {
+            chunk->trim_next = touched;
+            touched = chunk;
+        }
+        chain->next = chunk->trim_list;
+        chunk->trim_list = chain;
+        chunk->trimmed++;
+        chain = next;
+    }
+    
+    pool_item_t* keep = NULL;
+    while (touched != NULL) {
+        chunk_t* chunk = touched;
+        touched = chunk->trim_next;
+        
+        if (chunk->trimmed == chunk->capacity) {
+            // Nobody holds a pointer into it any more, including the thread
+            // that carved it: carving only ever stops at the end of a slab.
+            pool_slab_free(chunk);
+            continue;
+        }
+        
+        pool_item_t* tail = chunk->trim_list;
+        while (tail->next != NULL) {
+            tail = tail->next;
+        }
+        tail->next = keep;
+        keep = chunk->trim_list;
+        
+        chunk->trimmed = 0;
+        chunk->trim_list = NULL;
+        chunk->trim_next = NULL;
+    }
+    
+    pool_depot_put_chain(node, pool_index, keep);
+}
+
+// Gives back to the OS every slab that is entirely idle, considering every
+// magazine that sat in the depot untouched since the last trim plus any beyond
+// the depot's limit. Whatever the depot dipped to is what the program did not
+// need; anything above it is what bursts have actually been drawing on.
+static void pool_depot_trim_all(bool everything) {
+    while (atomic_exchange_explicit(&pool_trim_lock, true, memory_order_acquire)) {
+        while (atomic_load_explicit(&pool_trim_lock, memory_order_relaxed)) {
+            ponyint_cpu_relax();
+        }
+    }
+    
+    const pool_config_t* cfg = pool_config();
+    int32_t nodes = cfg->numa ? PONY_POOL_MAX_NODES : 1;
+    
+    for (int32_t n = 0; n < nodes; n++) {
+        for (int32_t i = 0; i < PONY_POOL_CLASSES; i++) {
+            pool_depot_t* depot = &pool_depots[n][i];
+            int64_t magazines = atomic_load_explicit(&depot->magazines, memory_order_relaxed);
+            int64_t release = atomic_load_explicit(&depot->low_water, memory_order_relaxed);
+            if (magazines - cfg->depot_max[i] > release) {
+                release = magazines - cfg->depot_max[i];
+            }
+            if (everything) {
+                release = magazines;
+            }
+            
+            // Magazines we take here are about to be unmapped, so no other
+            // taker may be reading their links; see pool_depot_take().
+            if (release > 0) {
+                pool_depot_shut(depot);
+                
+                pool_item_t* chain = NULL;
+                while (release-- > 0) {
+                    pool_item_t* mag = pool_depot_pop(depot);
+                    if (mag == NULL) {
+                        break;
+                    }
+                    pool_item_t* tail = mag;
+                    while (tail->next != NULL) {
+                        tail = tail->next;
+                    }
+                    tail->next = chain;
+                    chain = mag;
+                }
+                
+                if (chain != NULL) {
+                    pool_reclaim(n, i, chain);
+                }
+                
+                pool_depot_open(depot);
+            }
+            
+            atomic_store_explicit(&depot->low_water,
+                                  atomic_load_explicit(&depot->magazines, memory_order_relaxed),
+                                  memory_order_relaxed);
+        }
+    }
+    
+    atomic_store_explicit(&pool_trim_lock, false, memory_order_release);
+}
+
+static void pool_depot_trim() {
+    pool_depot_trim_all(false);
+}
+
+// ******** Outbound (NUMA) ********
+
+static void pool_outbound_flush(int32_t node, int32_t pool_index) {
+    pool_outbound_t* out = &pool_outbound[node][pool_index];
+    if (out->head == NULL) {
+        return;
+    }
+    
+    pool_depot_put(node, pool_index, out->head);
+    out->head = NULL;
+    out->length = 0;
+}
+
+static void pool_outbound_add(int32_t node, int32_t pool_index, void* p) {
+    pool_outbound_t* out = &pool_outbound[node][pool_index];
+    pool_item_t* item = (pool_item_t*)p;
+    item->next = out->head;
+    out->head = item;
+    out->length++;
+    
+    if (out->length >= pool_config()->magazine) {
+        pool_outbound_flush(node, pool_index);
+    }
+}
+
+// ******** Statistics ********
+//
+// Every thread that touches the pool gets a record of per class counters, on
+// a list that is only ever appended to. The owning thread writes its counters
+// without synchronisation and pony_pool_stats() reads them the same way, as the
+// scheduler and profiler counters are read: a sample can be a little behind
+// but is never torn on the platforms we support. A thread that exits gives its
+// record up for the next new thread to reuse, so short lived threads do not
+// grow the list.
+
+typedef struct pool_class_stats_t {
+    uint64_t hits;
+    uint64_t depot_takes;
+    uint64_t carves;
+    uint64_t frees;
+    uint64_t depot_puts;
+    uint64_t held;
+} pool_class_stats_t;
+
+typedef struct pool_thread_stats_t {
+    pool_class_stats_t classes[PONY_POOL_CLASSES];
+    uint64_t thread;
+    PONY_ATOMIC(bool) claimed;
+    struct pool_thread_stats_t* next;
+} pool_thread_stats_t;
+
+static PONY_ATOMIC(pool_thread_stats_t*) pool_stats_threads = NULL;
+static PONY_ATOMIC(uint64_t) pool_stats_thread_count = 0;
+static __pony_thread_local pool_thread_stats_t* pool_stats_local = NULL;
+
+static pool_thread_stats_t* pool_stats_claim() {
+    pool_thread_stats_t* record = atomic_load_explicit(&pool_stats_threads, memory_order_acquire);
+    while (record != NULL) {
+        bool expected = false;
+        if (!atomic_load_explicit(&record->claimed, memory_order_relaxed) &&
+            atomic_compare_exchange_strong_explicit(&record->claimed, &expected, true,
+                                                    memory_order_acquire, memory_order_relaxed)) {
+            memset(record->classes, 0, sizeof(record->classes));
+            break;
+        }
+        record = record->next;
+    }
+    
+    if (record == NULL) {
+        // From calloc() rather than the pool, which would recurse into us.
+        record = (pool_thread_stats_t*)calloc(1, sizeof(pool_thread_stats_t));
+        if (record == NULL) {
+            return NULL;
+        }
+        atomic_store_explicit(&record->claimed, true, memory_order_relaxed);
+        
+        pool_thread_stats_t* head = atomic_load_explicit(&pool_stats_threads, memory_order_relaxed);
+        do {
+            record->next = head;
+        } while (!atomic_compare_exchange_weak_explicit(&pool_stats_threads, &head, record,
+                                                        memory_order_release, memory_order_relaxed));
+    }
+    
+    record->thread = atomic_fetch_add_explicit(&pool_stats_thread_count, 1, memory_order_relaxed);
+    return record;
+}
+
+static pool_class_stats_t pool_stats_discard[PONY_POOL_CLASSES];
+
+static inline pool_class_stats_t* pool_stats(int32_t pool_index) {
+    if (pool_stats_local == NULL) {
+        pool_stats_local = pool_stats_claim();
+        if (pool_stats_local == NULL) {
+            // Out of memory for the record itself; count into the void.
+            return &pool_stats_discard[pool_index];
+        }
+    }
+    return &pool_stats_local->classes[pool_index];
+}
+
+static void pool_stats_release() {
+    if (pool_stats_local != NULL) {
+        for (int32_t i = 0; i < PONY_POOL_CLASSES; i++) {
+            pool_stats_local->classes[i].held = 0;
+        }
+        atomic_store_explicit(&pool_stats_local->claimed, false, memory_order_release);
+        pool_stats_local = NULL;
+    }
+}
+
+int pony_pool_class_count() {
+    return PONY_POOL_CLASSES;
+}
+
+int pony_pool_stats(pony_pool_stats_t * outStats, int maxStats) {
+    int n = 0;
+    pool_thread_stats_t* record = atomic_load_explicit(&pool_stats_threads, memory_order_acquire);
+    for (; record != NULL && n < maxStats; record = record->next) {
+        if (!atomic_load_explicit(&record->claimed, memory_order_acquire)) {
+            continue;
+        }
+        for (int32_t i = 0; i < PONY_POOL_CLASSES && n < maxStats; i++) {
+            pool_class_stats_t* st = &record->classes[i];
+            if (st->hits == 0 && st->carves == 0 && st->frees == 0) {
+                continue;
+            }
+            outStats[n].thread = record->thread;
+            outStats[n].size = pool_sizes[i];
+            outStats[n].hits = st->hits;
+            outStats[n].depot_takes = st->depot_takes;
+            outStats[n].slab_carves = st->carves;
+            outStats[n].frees = st->frees;
+            outStats[n].depot_puts = st->depot_puts;
+            outStats[n].held = st->held;
+            n++;
+        }
+    }
+    return n;
+}
+
+// ******** Local magazines ********
+
+static void* pool_pop(int32_t pool_index) {
     pool_local_t* pool = pool_local + pool_index;
+    
+    if (pool->pool == NULL) {
+        if (pool->spare != NULL) {
+            pool->pool = pool->spare;
+            pool->length = pool->spare_length;
+            pool->spare = NULL;
+            pool->spare_length = 0;
+        } else {
+            pool->pool = pool_depot_take(pool_depot_node(), pool_index);
+            if (pool->pool == NULL) {
+                return NULL;
+            }
+            pool->length = pool_chain_length(pool->pool);
+            pool_stats(pool_index)->depot_takes++;
+        }
+    }
+    
     pool_item_t* p = pool->pool;
-    if(p != NULL) {
-        pool->pool = p->next;
-        pool->length--;
-        return p;
+    pool->pool = p->next;
+    pool->length--;
+    return p;
+}
+
+static void pool_push(int32_t node, int32_t pool_index, void * p) {
+    pool_local_t* pool = pool_local + pool_index;
+    
+    if (pool->length >= pool_config()->magazine) {
+        if (pool->spare != NULL) {
+            pool_depot_put(node, pool_index, pool->spare);
+            pool_stats(pool_index)->depot_puts++;
+        }
+        pool->spare = pool->pool;
+        pool->spare_length = pool->length;
+        pool->pool = NULL;
+        pool->length = 0;
     }
-    return NULL;
+    
+    pool_item_t* lp = (pool_item_t*)p;
+    lp->next = pool->pool;
+    pool->pool = lp;
+    pool->length++;
 }
 
-static bool pool_push(void * p, size_t size) {
-    int32_t pool_index = ponyint_pool_index(size);
+// ******** Large allocations ********
+//
+// Anything above the largest class goes to malloc() behind a header holding
+// its size, so that ponyint_pool_free_ptr() can free it without being told.
+
+typedef struct pool_large_t {
+    size_t size;
+    size_t pad;
+} pool_large_t;
+
+static void* pool_large_alloc(size_t size) {
+    pool_large_t* header = (pool_large_t*)malloc(sizeof(pool_large_t) + size);
+    if (header == NULL) {
+        return NULL;
+    }
+    header->size = size;
+    atomic_fetch_add_explicit(&unsafe_pony_mapped_memory, size, memory_order_relaxed);
+    //pony_syslog2("Flynn", "+ %lu\n", (size_t)unsafe_pony_mapped_memory);
+    return header + 1;
+}
+
+static void pool_large_free(void* p) {
+    pool_large_t* header = ((pool_large_t*)p) - 1;
+    atomic_fetch_sub_explicit(&unsafe_pony_mapped_memory, header->size, memory_order_relaxed);
+#if DEBUG
+    memset(p, 55, header->size);
+#endif
+    free(header);
+    //pony_syslog2("Flynn", "- %lu\n", (size_t)unsafe_pony_mapped_memory);
+}
+
+static void pool_free_small(int32_t pool_index, void* p) {
+    pool_class_stats_t* st = pool_stats(pool_index);
+    st->frees++;
     
-    if (pool_index >= 0) {
-        pool_local_t* pool = pool_local + pool_index;
-        if (pool->length < 16384) {
-            pool_item_t* lp = (pool_item_t*)p;
-            lp->next = pool->pool;
-            pool->pool = lp;
-            pool->length++;
-            return true;
+    if (pool_numa_enabled()) {
+        int32_t node = (int32_t)pool_chunk_of(p)->node;
+        if (node != pool_my_node()) {
+            pool_outbound_add(node, pool_index, p);
+            return;
         }
+        pool_push(node, pool_index, p);
+    } else {
+        pool_push(0, pool_index, p);
     }
-    return false;
+    st->held = pool_local[pool_index].length + pool_local[pool_index].spare_length;
 }
 
 
@@ -140,56 +988,95 @@ static bool pool_push(void * p, size_t size) {
 // ******** Exposed API ********
 
 void * ponyint_pool_alloc(size_t size) {
-    size = ponyint_alloc_size(size);
+    int32_t pool_index = ponyint_pool_index(size);
+    if (pool_index < 0) {
+        return pool_large_alloc(size);
+    }
     
-    void * p = pool_pop(size);
+    pool_class_stats_t* st = pool_stats(pool_index);
+    void * p = pool_pop(pool_index);
     if (p != NULL) {
+        st->hits++;
+        st->held = pool_local[pool_index].length + pool_local[pool_index].spare_length;
         return p;
     }
-        
-    atomic_fetch_add_explicit(&unsafe_pony_mapped_memory, size, memory_order_relaxed);
-    //pony_syslog2("Flynn", "+ %lu\n", (size_t)unsafe_pony_mapped_memory);
-    return malloc(size);
+    st->carves++;
+    return pool_slab_carve(pool_index);
 }
 
 void ponyint_pool_free(void * p, size_t size) {
-    size = ponyint_alloc_size(size);
-    
-    if (pool_push(p, size)) {
+    int32_t pool_index = ponyint_pool_index(size);
+    if (pool_index < 0) {
+        pool_large_free(p);
         return;
     }
-    
-    atomic_fetch_sub_explicit(&unsafe_pony_mapped_memory, size, memory_order_relaxed);
-#if DEBUG
-    memset(p, 55, size);
-#endif
-    free(p);
-    
-    //pony_syslog2("Flynn", "- %lu\n", (size_t)unsafe_pony_mapped_memory);
+    pool_free_small(pool_index, p);
+}
+
+void ponyint_pool_free_ptr(void * p) {
+    chunk_t* chunk = ponyint_pagemap_get(p);
+    if (chunk == NULL) {
+        pool_large_free(p);
+        return;
+    }
+    pool_free_small((int32_t)chunk->pool_index, p);
 }
 
 pony_msg_t* pony_alloc_msg(size_t size, uint32_t msgId) {
     pony_msg_t* msg = (pony_msg_t*)ponyint_pool_alloc(size);
-    msg->alloc_size = (uint32_t)size;
+    if (msg == NULL) {
+        return NULL;
+    }
     msg->msgId = msgId;
     return msg;
 }
 
 void ponyint_pool_thread_cleanup() {
-    int pool_sizes[] = {32, 128, 256, 512, 2048, 4096};
+    int32_t node = pool_depot_node();
     
-    for (int i = 0; i < 6; i++) {
-        size_t pool_size = pool_sizes[i];
+    for (int32_t i = 0; i < PONY_POOL_CLASSES; i++) {
         pool_local_t* pool = pool_local + i;
-        while (pool->length > 0) {
-            void * p = pool_pop(pool_size);
-            if (p != NULL) {
-                atomic_fetch_sub_explicit(&unsafe_pony_mapped_memory, pool_size, memory_order_relaxed);
-                free(p);
-                //pony_syslog2("Flynn", "[%lu] after: %lu\n", pool_size, (size_t)unsafe_pony_mapped_memory);
-            }
+        
+        if (pool->pool != NULL) {
+            pool_depot_put(node, i, pool->pool);
+        }
+        if (pool->spare != NULL) {
+            pool_depot_put(node, i, pool->spare);
         }
+        pool->pool = NULL;
+        pool->length = 0;
+        pool->spare = NULL;
+        pool->spare_length = 0;
+        
+        for (int32_t n = 0; n < PONY_POOL_MAX_NODES; n++) {
+            pool_outbound_flush(n, i);
+        }
+        
+        // Carve out what is left of the current slab, so that the slab can be
+        // recognised as idle once everything else in it is.
+        pool_carve_t* carve = &pool_carve[i];
+        size_t size = pool_sizes[i];
+        pool_item_t* rest = NULL;
+        while (carve->next != NULL && carve->next + size <= carve->end) {
+            pool_item_t* item = (pool_item_t*)carve->next;
+            item->next = rest;
+            rest = item;
+            carve->next += size;
+        }
+        carve->next = NULL;
+        carve->end = NULL;
+        pool_depot_put_chain(node, i, rest);
     }
+    
+    pool_stats_release();
+}
+
+void ponyint_pool_release_idle() {
+    // The depot would otherwise hold on to its memory until the next trim,
+    // which after shutdown never comes. Only done once every scheduler has
+    // stopped; an ordinary thread exiting must not evict magazines the
+    // running schedulers are about to reuse.
+    pool_depot_trim_all(true);
 }
 
 /*
@@ -9,8 +9,10 @@
 
 extern void* ponyint_pool_alloc(size_t size);
 extern void* ponyint_pool_free(void* p, size_t size);
+extern void ponyint_pool_free_ptr(void* p);
 extern pony_msg_t* pony_alloc_msg(size_t size, uint32_t msgId);
 extern void ponyint_pool_thread_cleanup();
+extern void ponyint_pool_release_idle();
 extern void ponyint_update_memory_usage();
 
 extern size_t ponyint_total_memory();
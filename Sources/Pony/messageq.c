@@ -7,9 +7,9 @@
 #include "messageq.h"
 #include "memory.h"
 
-static bool messageq_push(messageq_t* q, pony_msg_t* first, pony_msg_t* last)
+static bool messageq_push(messageq_t* q, pony_msg_t* first, pony_msg_t* last, int32_t count)
 {
-    atomic_fetch_add_explicit(&q->num_messages, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&q->pushed, (uint64_t)count, memory_order_relaxed);
     
     atomic_store_explicit(&last->next, NULL, memory_order_relaxed);
     
@@ -34,14 +34,14 @@ static bool messageq_push(messageq_t* q, pony_msg_t* first, pony_msg_t* last)
 void ponyint_messageq_init(messageq_t* q)
 {
     pony_msg_t* stub = ponyint_pool_alloc(sizeof(pony_msg_t));
-    stub->alloc_size = sizeof(pony_msg_t);
     atomic_store_explicit(&stub->next, NULL, memory_order_relaxed);
     
     atomic_store_explicit(&q->head, (pony_msg_t*)((uintptr_t)stub | 1),
                           memory_order_relaxed);
     q->tail = stub;
     
-    atomic_store_explicit(&q->num_messages, 0, memory_order_relaxed);
+    atomic_store_explicit(&q->pushed, 0, memory_order_relaxed);
+    atomic_store_explicit(&q->popped, 0, memory_order_relaxed);
 }
 
 void ponyint_messageq_destroy(messageq_t* q)
@@ -51,15 +51,19 @@ void ponyint_messageq_destroy(messageq_t* q)
     pony_msg_t* tail = q->tail;
     assert((((uintptr_t)atomic_load_explicit(&q->head, memory_order_relaxed) & ~(uintptr_t)1)) == (uintptr_t)tail);
     
-    ponyint_pool_free(tail, tail->alloc_size);
+    ponyint_pool_free_ptr(tail);
     atomic_store_explicit(&q->head, NULL, memory_order_relaxed);
     q->tail = NULL;
-    atomic_store_explicit(&q->num_messages, 0, memory_order_relaxed);
 }
 
 bool ponyint_actor_messageq_push(messageq_t* q, pony_msg_t* first, pony_msg_t* last)
 {
-    return messageq_push(q, first, last);
+    return messageq_push(q, first, last, 1);
+}
+
+bool ponyint_actor_messageq_push_batch(messageq_t* q, pony_msg_t* first, pony_msg_t* last, int32_t count)
+{
+    return messageq_push(q, first, last, count);
 }
 
 pony_msg_t* ponyint_actor_messageq_pop(messageq_t* q)
@@ -71,14 +75,21 @@ pony_msg_t* ponyint_actor_messageq_pop(messageq_t* q)
     {
         q->tail = next;
         atomic_thread_fence(memory_order_acquire);
-        ponyint_pool_free(tail, tail->alloc_size);
+        ponyint_pool_free_ptr(tail);
     }
     
     return next;
 }
 
+static inline void messageq_count_pop(messageq_t* q)
+{
+    // Only the consumer writes popped, so this needs no read-modify-write.
+    uint64_t popped = atomic_load_explicit(&q->popped, memory_order_relaxed);
+    atomic_store_explicit(&q->popped, popped + 1, memory_order_release);
+}
+
 void ponyint_actor_messageq_pop_mark_done(messageq_t* q) {
-    atomic_fetch_sub_explicit(&q->num_messages, 1, memory_order_relaxed);
+    messageq_count_pop(q);
 }
 
 pony_msg_t* ponyint_thread_messageq_pop(messageq_t* q)
@@ -90,9 +101,9 @@ pony_msg_t* ponyint_thread_messageq_pop(messageq_t* q)
     {
         q->tail = next;
         atomic_thread_fence(memory_order_acquire);
-        ponyint_pool_free(tail, tail->alloc_size);
+        ponyint_pool_free_ptr(tail);
         
-        atomic_fetch_sub_explicit(&q->num_messages, 1, memory_order_relaxed);
+        messageq_count_pop(q);
     }
     
     return next;
@@ -103,20 +114,31 @@ bool ponyint_messageq_markempty(messageq_t* q)
     pony_msg_t* tail = q->tail;
     pony_msg_t* head = atomic_load_explicit(&q->head, memory_order_relaxed);
     
-    if(((uintptr_t)head & 1) != 0) {
-        atomic_store_explicit(&q->num_messages, 0, memory_order_relaxed);
+    if(((uintptr_t)head & 1) != 0)
         return true;
-    }
     
     if(head != tail)
         return false;
     
     head = (pony_msg_t*)((uintptr_t)head | 1);
     
-    bool empty = atomic_compare_exchange_strong_explicit(&q->head, &tail, head,
-                                                         memory_order_release, memory_order_relaxed);
-    if(empty) {
-        atomic_store_explicit(&q->num_messages, 0, memory_order_relaxed);
-    }
-    return empty;
+    return atomic_compare_exchange_strong_explicit(&q->head, &tail, head,
+                                                   memory_order_release, memory_order_relaxed);
+}
+
+int32_t ponyint_messageq_count(messageq_t* q)
+{
+    // Read popped first, so every message it counts was already counted in
+    // pushed. Pushes, and pops made after that first load, can only add to
+    // pushed without subtracting, so under concurrency the result errs high.
+    // It can only go negative if a producer's increment is not yet visible
+    // here; clamp for that case.
+    uint64_t popped = atomic_load_explicit(&q->popped, memory_order_acquire);
+    uint64_t pushed = atomic_load_explicit(&q->pushed, memory_order_relaxed);
+    
+    if(pushed <= popped)
+        return 0;
+    
+    uint64_t n = pushed - popped;
+    return n > INT32_MAX ? INT32_MAX : (int32_t)n;
 }
@@ -6,14 +6,23 @@
 #ifndef messageq_h
 #define messageq_h
 
+#include <stdalign.h>
 #include "atomics.h"
 #include "ponyrt.h"
 
+// The queue length is never counted directly. Producers bump pushed on the line
+// they already own for the exchange on head, and the single consumer bumps
+// popped on its own line with a plain store, so a message costs no extra
+// read-modify-write on the line the other side is using. The difference is an
+// approximate count: exact once the queue is quiet, and never reported below
+// zero while pushes and pops race with the reader.
 typedef struct messageq_t
 {
     PONY_ATOMIC(pony_msg_t*) head;
-    pony_msg_t* tail;
-    PONY_ATOMIC(int32_t) num_messages;
+    PONY_ATOMIC(uint64_t) pushed;
+
+    alignas(64) pony_msg_t* tail;
+    PONY_ATOMIC(uint64_t) popped;
 } messageq_t;
 
 #define UNKNOWN_SCHEDULER -1
@@ -24,6 +33,10 @@ void ponyint_messageq_destroy(messageq_t* q);
 
 bool ponyint_actor_messageq_push(messageq_t* q, pony_msg_t* first, pony_msg_t* last);
 
+// Pushes count messages already linked from first to last through their next
+// pointers, with the same single exchange as one message.
+bool ponyint_actor_messageq_push_batch(messageq_t* q, pony_msg_t* first, pony_msg_t* last, int32_t count);
+
 pony_msg_t* ponyint_actor_messageq_pop(messageq_t* q);
 
 void ponyint_actor_messageq_pop_mark_done(messageq_t* q);
@@ -32,4 +45,8 @@ pony_msg_t* ponyint_thread_messageq_pop(messageq_t* q);
 
 bool ponyint_messageq_markempty(messageq_t* q);
 
+// Messages pushed and not yet marked done, which includes the one currently
+// being run.
+int32_t ponyint_messageq_count(messageq_t* q);
+
 #endif /* messageq_h */
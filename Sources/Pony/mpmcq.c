@@ -6,190 +6,71 @@
 #define PONY_WANT_ATOMIC_DEFS
 
 #include "mpmcq.h"
-#include "memory.h"
-#include "cpu.h"
 #include <stdio.h>
 
-typedef struct mpmcq_node_t mpmcq_node_t;
+// The queue is a Treiber stack. A push only needs head to be unchanged between
+// its load and its CAS; a consumer never looks at an individual link while it
+// is shared, because it takes the whole stack with one exchange. So there is
+// no ABA to protect against and no node to keep alive for a racing consumer,
+// which is what the old node based queue needed its pop_lock and its wait on
+// tail->data for.
 
-struct mpmcq_node_t
+static inline void** link_of(mpmcq_t* q, void* item)
 {
-    PONY_ATOMIC(mpmcq_node_t*) next;
-    PONY_ATOMIC(void*) data;
-};
-
-#define MPMCQ_MAX_SPINS 64
-
-static inline void mpmcq_backoff(uint32_t* spins)
-{
-    if(++(*spins) < MPMCQ_MAX_SPINS) {
-        ponyint_cpu_relax();
-    } else {
-        ponyint_cpu_yield();
-        *spins = 0;
-    }
-}
-
-static mpmcq_node_t* node_alloc(void* data)
-{
-    mpmcq_node_t* node = ponyint_pool_alloc(sizeof(mpmcq_node_t));
-    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
-    atomic_store_explicit(&node->data, data, memory_order_relaxed);
-    return node;
-}
-
-static void node_free(mpmcq_node_t* node)
-{
-    ponyint_pool_free(node, sizeof(mpmcq_node_t));
+    return (void**)((char*)item + q->link_offset);
 }
 
-void ponyint_mpmcq_init(mpmcq_t* q)
+void ponyint_mpmcq_init(mpmcq_t* q, size_t link_offset)
 {
-    mpmcq_node_t* node = node_alloc(NULL);
-    
-    atomic_store_explicit(&q->head, node, memory_order_relaxed);
-    q->tail.object = node;
-    q->tail.counter = 0;
-    
-    atomic_store_explicit(&q->num_messages, 0, memory_order_relaxed);
-    atomic_store_explicit(&q->pop_lock, false, memory_order_relaxed);
+    atomic_store_explicit(&q->head, NULL, memory_order_relaxed);
+    q->link_offset = link_offset;
 }
 
 void ponyint_mpmcq_destroy(mpmcq_t* q)
 {
     atomic_store_explicit(&q->head, NULL, memory_order_relaxed);
-    node_free(q->tail.object);
-    q->tail.object = NULL;
-    atomic_store_explicit(&q->num_messages, 0, memory_order_relaxed);
 }
 
-void ponyint_mpmcq_push(mpmcq_t* q, void* data)
+void ponyint_mpmcq_push(mpmcq_t* q, void* item)
 {
-    mpmcq_node_t* node = node_alloc(data);
-    
-    atomic_fetch_add_explicit(&q->num_messages, 1, memory_order_relaxed);
-    
-    // Without that fence, the store to node->next in node_alloc could be
-    // reordered after the exchange on the head and after the store to prev->next
-    // done by the next push, which would result in the pop incorrectly seeing
-    // the queue as empty.
-    // Also synchronise with the pop on prev->next.
-    atomic_thread_fence(memory_order_release);
-    
-    mpmcq_node_t* prev = atomic_exchange_explicit(&q->head, node, memory_order_relaxed);
-    
-    atomic_store_explicit(&prev->next, node, memory_order_release);
+    void* head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    
+    // The release on success publishes the link, and everything the pusher
+    // wrote to the item before it, to whichever consumer takes it.
+    do {
+        *link_of(q, item) = head;
+    } while(!atomic_compare_exchange_weak_explicit(&q->head, &head, item,
+                                                   memory_order_release, memory_order_relaxed));
 }
 
-void ponyint_mpmcq_push_single(mpmcq_t* q, void* data)
+void* ponyint_mpmcq_pop_all(mpmcq_t* q)
 {
-    mpmcq_node_t* node = node_alloc(data);
+    // Checked without the exchange first: every scheduler polls the inject
+    // queues on every loop, and they are usually empty.
+    if(atomic_load_explicit(&q->head, memory_order_relaxed) == NULL)
+        return NULL;
     
-    atomic_fetch_add_explicit(&q->num_messages, 1, memory_order_relaxed);
+    void* item = atomic_exchange_explicit(&q->head, NULL, memory_order_acquire);
     
-    // If we have a single producer, the swap of the head need not be atomic RMW.
-    mpmcq_node_t* prev = atomic_load_explicit(&q->head, memory_order_relaxed);
-    atomic_store_explicit(&q->head, node, memory_order_relaxed);
+    // Newest first on the stack; reverse into oldest first.
+    void* oldest = NULL;
+    while(item != NULL)
+    {
+        void* next = *link_of(q, item);
+        *link_of(q, item) = oldest;
+        oldest = item;
+        item = next;
+    }
     
-    // If we have a single producer, the fence can be replaced with a store
-    // release on prev->next.
-    atomic_store_explicit(&prev->next, node, memory_order_release);
+    return oldest;
 }
 
-int64_t ponyint_mpmcq_num_messages(mpmcq_t* q)
+void* ponyint_mpmcq_next(mpmcq_t* q, void* item)
 {
-    return atomic_load_explicit(&q->num_messages, memory_order_relaxed);
+    return *link_of(q, item);
 }
 
-void* ponyint_mpmcq_pop(mpmcq_t* q)
+bool ponyint_mpmcq_is_empty(mpmcq_t* q)
 {
-    if(atomic_load_explicit(&q->num_messages, memory_order_relaxed) <= 0)
-        return NULL;
-
-    uint32_t spins = 0;
-
-    while(atomic_exchange_explicit(&q->pop_lock, true, memory_order_acquire)) {
-        do {
-            mpmcq_backoff(&spins);
-        } while(atomic_load_explicit(&q->pop_lock, memory_order_relaxed));
-    }
-
-    PONY_ABA_PROTECTED_PTR(mpmcq_node_t) cmp;
-    PONY_ABA_PROTECTED_PTR(mpmcq_node_t) xchg;
-    mpmcq_node_t* tail;
-    // Load the tail non-atomically. If object and counter are out of sync, we'll
-    // do an additional CAS iteration which isn't less efficient than doing an
-    // atomic initial load.
-    cmp.object = q->tail.object;
-    cmp.counter = q->tail.counter;
-    
-    mpmcq_node_t* next;
-    
-    do
-    {
-        tail = cmp.object;
-        // Get the next node rather than the tail. The tail is either a stub or has
-        // already been consumed.
-        if(tail == NULL) {
-            atomic_store_explicit(&q->pop_lock, false, memory_order_release);
-            return NULL;
-        }
-        
-        // Note: Xcode address sanitizer fails on this call. unclear whether this is
-        // an actual problem with this fencing mechanism or a red herring
-        next = atomic_load_explicit(&tail->next, memory_order_relaxed);
-        
-        if(next == NULL) {
-            atomic_store_explicit(&q->pop_lock, false, memory_order_release);
-            return NULL;
-        }
-        
-        xchg.object = next;
-        xchg.counter = cmp.counter + 1;
-        
-        // NOTE: the per-queue pop_lock guarantees we are the only consumer of this
-        // queue right now, so the tail update need not be an atomic RMW.
-        if (q->tail.object == cmp.object) {
-            q->tail = xchg;
-            continue;
-        }
-        break;
-    }
-    while(true);
-    
-    // Synchronise on tail->next to ensure we see the write to next->data from
-    // the push. Also synchronise on next->data (see comment below).
-    // This is a standalone fence instead of a synchronised compare_exchange
-    // operation because the latter would result in unnecessary synchronisation
-    // on each loop iteration.
-    atomic_thread_fence(memory_order_acq_rel);
-    
-    void* data = atomic_load_explicit(&next->data, memory_order_acquire);
-    
-    // Since we will be freeing the old tail, we need to be sure no other
-    // consumer is still reading the old tail. To do this, we set the data
-    // pointer of our new tail to NULL, and we wait until the data pointer of
-    // the old tail is NULL.
-    // We synchronised on next->data to make sure all memory writes we've done
-    // will be visible from the thread that will free our tail when it starts
-    // freeing it.
-    atomic_store_explicit(&next->data, NULL, memory_order_release);
-    
-    spins = 0;
-    while(atomic_load_explicit(&tail->data, memory_order_acquire) != NULL)
-        mpmcq_backoff(&spins);
-    
-    // Synchronise on tail->data to make sure we see every previous write to the
-    // old tail before freeing it. This is a standalone fence to avoid
-    // unnecessary synchronisation on each loop iteration.
-    atomic_thread_fence(memory_order_acquire);
-    
-    node_free(tail);
-    
-    if (data != NULL) {
-        atomic_fetch_sub_explicit(&q->num_messages, 1, memory_order_relaxed);
-    }
-    
-    atomic_store_explicit(&q->pop_lock, false, memory_order_release);
-    return data;
+    return atomic_load_explicit(&q->head, memory_order_relaxed) == NULL;
 }
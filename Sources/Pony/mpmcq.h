@@ -1,4 +1,3 @@
-
 // Note: This code is derivative of the Pony runtime; see README.md for more details
 
 #include "platform.h"
@@ -8,32 +7,38 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdalign.h>
 #include <stdbool.h>
 #include "atomics.h"
 
-typedef struct mpmcq_node_t mpmcq_node_t;
-
-PONY_ABA_PROTECTED_PTR_DECLARE(mpmcq_node_t)
-
+// An intrusive multi producer, multi consumer queue. The link lives inside the
+// queued item, at link_offset, so an item may be on at most one mpmcq at a
+// time. Pushing is a single CAS and taking is a single exchange that claims
+// everything queued; neither allocates, locks or spins on another thread.
+//
+// Items come back oldest first within a take. Across takes the order is only
+// approximately FIFO, which is all the scheduler's inject queues need.
 typedef struct mpmcq_t
 {
-    alignas(64) PONY_ATOMIC(mpmcq_node_t*) head;
-    PONY_ATOMIC_ABA_PROTECTED_PTR(mpmcq_node_t) tail;
-    PONY_ATOMIC(int64_t) num_messages;
-    alignas(64) PONY_ATOMIC(bool) pop_lock;
+    alignas(64) PONY_ATOMIC(void*) head;
+    size_t link_offset;
 } mpmcq_t;
 
-void ponyint_mpmcq_init(mpmcq_t* q);
+void ponyint_mpmcq_init(mpmcq_t* q, size_t link_offset);
 
 void ponyint_mpmcq_destroy(mpmcq_t* q);
 
-void ponyint_mpmcq_push(mpmcq_t* q, void* data);
+void ponyint_mpmcq_push(mpmcq_t* q, void* item);
 
-void ponyint_mpmcq_push_single(mpmcq_t* q, void* data);
+// Claims every item on the queue and returns the oldest, or NULL. Walk the rest
+// with ponyint_mpmcq_next(); they belong to the caller and must each be handed
+// on, which may include pushing them back. Read an item's next before handing
+// it on, since a push reuses the link.
+void* ponyint_mpmcq_pop_all(mpmcq_t* q);
 
-void* ponyint_mpmcq_pop(mpmcq_t* q);
+void* ponyint_mpmcq_next(mpmcq_t* q, void* item);
 
-int64_t ponyint_mpmcq_num_messages(mpmcq_t* q);
+bool ponyint_mpmcq_is_empty(mpmcq_t* q);
 
 #endif /* mpmcq_h */
@@ -0,0 +1,116 @@
+// Note: This code is derivative of the Pony runtime; see README.md for more details
+
+#include "platform.h"
+
+#define PONY_WANT_ATOMIC_DEFS
+
+#include "pagemap.h"
+#include "atomics.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Maps every 64KB granule of the address space to the chunk_t that owns it, or
+// NULL. Chunks are the pool allocator's slabs, always exactly one granule and
+// aligned to it, so one entry covers a whole chunk.
+//
+// 48 bits of address less 16 bits of granule leaves 32 bits of index, split
+// 12/10/10 across three levels. Interior levels are created on first use and
+// never freed; a fully populated leaf covers 64MB of address space, so even a
+// large heap only ever needs a handful of them.
+
+#define PAGEMAP_GRANULE_BITS 16
+#define PAGEMAP_ADDRESS_BITS 48
+
+#define PAGEMAP_L1_BITS 12
+#define PAGEMAP_L2_BITS 10
+#define PAGEMAP_L3_BITS 10
+
+#define PAGEMAP_L1_SIZE (1 << PAGEMAP_L1_BITS)
+#define PAGEMAP_L2_SIZE (1 << PAGEMAP_L2_BITS)
+#define PAGEMAP_L3_SIZE (1 << PAGEMAP_L3_BITS)
+
+typedef struct pagemap_leaf_t
+{
+    PONY_ATOMIC(chunk_t*) chunks[PAGEMAP_L3_SIZE];
+} pagemap_leaf_t;
+
+typedef struct pagemap_mid_t
+{
+    PONY_ATOMIC(pagemap_leaf_t*) leaves[PAGEMAP_L2_SIZE];
+} pagemap_mid_t;
+
+static PONY_ATOMIC(pagemap_mid_t*) pagemap_root[PAGEMAP_L1_SIZE];
+
+static inline uintptr_t pagemap_index(const void* addr)
+{
+    // Drop any pointer tag in the top byte (arm64 TBI, MTE) before indexing.
+    uintptr_t a = (uintptr_t)addr & ((((uintptr_t)1) << PAGEMAP_ADDRESS_BITS) - 1);
+    return a >> PAGEMAP_GRANULE_BITS;
+}
+
+chunk_t* ponyint_pagemap_get(const void* addr)
+{
+    uintptr_t index = pagemap_index(addr);
+    uintptr_t i1 = index >> (PAGEMAP_L2_BITS + PAGEMAP_L3_BITS);
+    uintptr_t i2 = (index >> PAGEMAP_L3_BITS) & (PAGEMAP_L2_SIZE - 1);
+    uintptr_t i3 = index & (PAGEMAP_L3_SIZE - 1);
+
+    pagemap_mid_t* mid = atomic_load_explicit(&pagemap_root[i1], memory_order_acquire);
+    if(mid == NULL)
+        return NULL;
+
+    pagemap_leaf_t* leaf = atomic_load_explicit(&mid->leaves[i2], memory_order_acquire);
+    if(leaf == NULL)
+        return NULL;
+
+    return atomic_load_explicit(&leaf->chunks[i3], memory_order_acquire);
+}
+
+bool ponyint_pagemap_set(const void* addr, chunk_t* chunk)
+{
+    uintptr_t index = pagemap_index(addr);
+    uintptr_t i1 = index >> (PAGEMAP_L2_BITS + PAGEMAP_L3_BITS);
+    uintptr_t i2 = (index >> PAGEMAP_L3_BITS) & (PAGEMAP_L2_SIZE - 1);
+    uintptr_t i3 = index & (PAGEMAP_L3_SIZE - 1);
+
+    // Interior levels come from calloc() rather than the pool, which is the
+    // pagemap's only client and would otherwise recurse into itself. Clearing
+    // an entry never needs one.
+    pagemap_mid_t* mid = atomic_load_explicit(&pagemap_root[i1], memory_order_acquire);
+    if(mid == NULL)
+    {
+        if(chunk == NULL)
+            return true;
+
+        pagemap_mid_t* fresh = (pagemap_mid_t*)calloc(1, sizeof(pagemap_mid_t));
+        if(fresh == NULL)
+            return false;
+
+        if(atomic_compare_exchange_strong_explicit(&pagemap_root[i1], &mid, fresh,
+                                                   memory_order_acq_rel, memory_order_acquire))
+            mid = fresh;
+        else
+            free(fresh);
+    }
+
+    pagemap_leaf_t* leaf = atomic_load_explicit(&mid->leaves[i2], memory_order_acquire);
+    if(leaf == NULL)
+    {
+        if(chunk == NULL)
+            return true;
+
+        pagemap_leaf_t* fresh = (pagemap_leaf_t*)calloc(1, sizeof(pagemap_leaf_t));
+        if(fresh == NULL)
+            return false;
+
+        if(atomic_compare_exchange_strong_explicit(&mid->leaves[i2], &leaf, fresh,
+                                                   memory_order_acq_rel, memory_order_acquire))
+            leaf = fresh;
+        else
+            free(fresh);
+    }
+
+    atomic_store_explicit(&leaf->chunks[i3], chunk, memory_order_release);
+    return true;
+}
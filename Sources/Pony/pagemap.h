@@ -3,6 +3,7 @@
 #include "platform.h"
 
 #include <sys/types.h>
+#include <stdbool.h>
 
 #ifndef mem_pagemap_h
 #define mem_pagemap_h
@@ -11,6 +12,8 @@ typedef struct chunk_t chunk_t;
 
 chunk_t* ponyint_pagemap_get(const void* addr);
 
-void ponyint_pagemap_set(const void* addr, chunk_t* chunk);
+// Returns false if the entry could not be recorded because memory for the map
+// itself ran out. Clearing an entry always succeeds.
+bool ponyint_pagemap_set(const void* addr, chunk_t* chunk);
 
 #endif
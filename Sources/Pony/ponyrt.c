@@ -14,7 +14,9 @@
 #endif
 
 #include <string.h>
+#include <stdalign.h>
 
+#include "pony.h"
 #include "ponyrt.h"
 
 #include "messageq.h"
@@ -44,14 +46,16 @@ uint64_t pony_actor_new_then_id() {
 
 static bool pony_is_inited = false;
 
-bool pony_startup(int scheduler_count, int min_scheduler_count) {
+bool pony_startup(int scheduler_count, int min_scheduler_count,
+                  int min_active_scheduler_count, int suspend_after_ms, int revive_backlog) {
     if (pony_is_inited) { return true; }
     
     //pony_syslog2("Flynn", "pony_startup()\n");
     
     ponyint_cpu_init();
     
-    ponyint_sched_init(scheduler_count, min_scheduler_count);
+    ponyint_sched_init(scheduler_count, min_scheduler_count,
+                       min_active_scheduler_count, suspend_after_ms, revive_backlog);
     
     pony_is_inited = ponyint_sched_start();
     
@@ -69,6 +73,12 @@ void pony_shutdown(bool waitForRemotes) {
     //pony_syslog2("Flynn", "pony scheduler shutdown\n");
     ponyint_sched_stop();
     
+    // The calling thread allocated messages too; hand back what it holds so
+    // the slabs it was carving can be recognised as idle, then give back
+    // every slab that now is.
+    ponyint_pool_thread_cleanup();
+    ponyint_pool_release_idle();
+    
     //pony_syslog2("Flynn", "pony shutdown finished\n");
     pony_is_inited = false;
 }
@@ -105,11 +115,97 @@ void * pony_actor_create() {
     return ponyint_create_actor(pony_ctx());
 }
 
+uint64_t pony_actor_uid(void * actor) {
+    return ((pony_actor_t *)actor)->uid;
+}
+
+// The top bit of state marks the reference as claimed; the rest counts the
+// threads between acquire() and release(). Padded to a cache line so that
+// references to different busy actors do not share one.
+#define ACTOR_REF_CLAIMED (((uint64_t)1) << 63)
+
+struct pony_actor_ref_t {
+    alignas(64) PONY_ATOMIC(uint64_t) state;
+    void * actor;
+};
+
+pony_actor_ref_t * pony_actor_ref_create(void * actor) {
+    pony_actor_ref_t * ref = (pony_actor_ref_t *)ponyint_pool_alloc(sizeof(pony_actor_ref_t));
+    atomic_store_explicit(&ref->state, (actor == NULL) ? ACTOR_REF_CLAIMED : 0, memory_order_relaxed);
+    ref->actor = actor;
+    return ref;
+}
+
+void * pony_actor_ref_acquire(pony_actor_ref_t * ref) {
+    if (ref == NULL) { return NULL; }
+    
+    uint64_t state = atomic_fetch_add_explicit(&ref->state, 1, memory_order_acquire);
+    if ((state & ACTOR_REF_CLAIMED) != 0) {
+        atomic_fetch_sub_explicit(&ref->state, 1, memory_order_release);
+        return NULL;
+    }
+    return ref->actor;
+}
+
+void pony_actor_ref_release(pony_actor_ref_t * ref) {
+    if (ref == NULL) { return; }
+    atomic_fetch_sub_explicit(&ref->state, 1, memory_order_release);
+}
+
+void * pony_actor_ref_claim(pony_actor_ref_t * ref) {
+    if (ref == NULL) { return NULL; }
+    
+    uint64_t state = atomic_fetch_or_explicit(&ref->state, ACTOR_REF_CLAIMED, memory_order_acq_rel);
+    if ((state & ACTOR_REF_CLAIMED) != 0) {
+        return NULL;
+    }
+    
+    // New acquires now back straight out; wait for the ones already inside to
+    // finish with the actor before handing it over to be destroyed.
+    uint32_t spins = 0;
+    while ((atomic_load_explicit(&ref->state, memory_order_acquire) & ~ACTOR_REF_CLAIMED) != 0) {
+        if (++spins < 64) {
+            ponyint_cpu_relax();
+        } else {
+            ponyint_cpu_yield();
+            spins = 0;
+        }
+    }
+    return ref->actor;
+}
+
+void pony_actor_ref_free(pony_actor_ref_t * ref) {
+    if (ref == NULL) { return; }
+    ponyint_pool_free(ref, sizeof(pony_actor_ref_t));
+}
+
 void pony_actor_send_message(void * actor, void * argumentPtr, uint64_t then_id, void (*handleMessageFunc)(void * message)) {
     if (pony_is_inited == false) { return; }
     pony_send_message(pony_ctx(), actor, argumentPtr, then_id, handleMessageFunc);
 }
 
+void * pony_actor_alloc_inline_message(size_t payloadSize) {
+    return pony_alloc_inline_msg(payloadSize);
+}
+
+void pony_actor_send_inline_message(void * actor, void * payload, uint64_t then_id, void (*handleMessageFunc)(void * payload)) {
+    if (pony_is_inited == false) {
+        pony_free_inline_msg(payload);
+        return;
+    }
+    pony_send_inline_message(pony_ctx(), actor, payload, then_id, handleMessageFunc);
+}
+
+void pony_actor_send_batch(void * actor, void ** payloads, int count, void (*handleMessageFunc)(void * payload)) {
+    if (pony_is_inited == false) {
+        for (int i = 0; i < count; i++) {
+            pony_free_inline_msg(payloads[i]);
+        }
+        return;
+    }
+    pony_send_inline_batch(pony_ctx(), actor, payloads, count, handleMessageFunc);
+}
+
 void pony_actor_complete_then_message(void * actor, void * argumentPtr, void (*handleMessageFunc)(void * message)) {
     if (pony_is_inited == false) { return; }
     pony_complete_then_message(pony_ctx(), actor, argumentPtr, handleMessageFunc);
@@ -141,6 +237,16 @@ int pony_actor_getbatchSize(void * actor) {
     return ponyint_actor_getbatchSize(actor);
 }
 
+void pony_actor_setmailboxLimit(void * actor, int mailboxLimit) {
+    if (pony_is_inited == false) { return; }
+    ponyint_actor_setmailboxLimit(actor, mailboxLimit);
+}
+
+int pony_actor_getmailboxLimit(void * actor) {
+    if (pony_is_inited == false) { return 0; }
+    return ponyint_actor_getmailboxLimit(actor);
+}
+
 void pony_actor_setcoreAffinity(void * actor, int coreAffinity) {
     if (pony_is_inited == false) { return; }
     ponyint_actor_setcoreAffinity(actor, coreAffinity);
@@ -179,15 +285,13 @@ bool pony_actor_is_suspended(void * actor) {
 int pony_actors_load_balance(void * actorArray, int num_actors) {
     if (pony_is_inited == false) { return 0; }
     pony_actor_t ** actorsPtr = (pony_actor_t**)actorArray;
-    pony_actor_t * minActor = *actorsPtr;
+    int32_t minCount = ponyint_messageq_count(&actorsPtr[0]->queue);
     int minIdx = 0;
-    for (int i = 0; i < num_actors; i++) {
-        if(actorsPtr[i]->queue.num_messages < minActor->queue.num_messages) {
-            minActor = actorsPtr[i];
+    for (int i = 1; i < num_actors && minCount > 0; i++) {
+        int32_t count = ponyint_messageq_count(&actorsPtr[i]->queue);
+        if(count < minCount) {
+            minCount = count;
             minIdx = i;
-            if (minActor->queue.num_messages == 0) {
-                return minIdx;
-            }
         }
     }
     return minIdx;
@@ -195,31 +299,12 @@ int pony_actors_load_balance(void * actorArray, int num_actors) {
 
 bool pony_actors_should_wait(int min_msgs, void * actorArray, int num_actors) {
     if (pony_is_inited == false) { return false; }
-    // we hard wait until all actors we have been given have no messages waiting
-    pony_actor_t ** actorsPtr = (pony_actor_t**)actorArray;
-    int32_t n = 0;
-    for (int i = 0; i < num_actors; i++) {
-        n += actorsPtr[i]->queue.num_messages;
-    }
-    if (n <= min_msgs) {
-        return false;
-    }
-    return true;
+    return ponyint_actors_should_wait(min_msgs, (pony_actor_t**)actorArray, num_actors);
 }
 
 void pony_actors_wait(int min_msgs, void * actorArray, int num_actors) {
     if (pony_is_inited == false) { return; }
-    // we hard wait until all actors we have been given have no messages waiting
-    pony_actor_t ** actorsPtr = (pony_actor_t**)actorArray;
-    int scaling_sleep = 10;
-    int max_scaling_sleep = 500;
-    while (pony_actors_should_wait(min_msgs, actorArray, num_actors)) {
-        ponyint_cpu_sleep(scaling_sleep);
-        scaling_sleep += 1;
-        if (scaling_sleep > max_scaling_sleep) {
-            scaling_sleep = max_scaling_sleep;
-        }
-    }
+    ponyint_actors_wait(min_msgs, (pony_actor_t**)actorArray, num_actors);
 }
 
 void pony_actor_wait(int min_msgs, void * actor) {
@@ -31,6 +31,7 @@ char * pony_dns_resolve_txt(const char * domain);
 #define kRemote_SendCoreCount 8
 #define kRemote_SendHeartbeat 9
 #define kRemote_DestroyActorAck 10
+#define kMessageInline 11
 
 typedef struct pony_actor_t pony_actor_t;
 
@@ -39,14 +40,14 @@ typedef struct pony_ctx_t pony_ctx_t;
 /** Message header.
  *
  * This must be the first field in any message structure. The ID is used for
- * dispatch. The index is a pool allocator index and is used for freeing the
- * message. The next pointer should not be read or set.
+ * dispatch. Messages are freed with ponyint_pool_free_ptr(), which finds their
+ * size class from the address alone. The next pointer should not be read or
+ * set.
  */
 typedef struct pony_msg_t pony_msg_t;
 
 struct pony_msg_t
 {
-    uint32_t alloc_size;
     uint32_t msgId;
     PONY_ATOMIC(pony_msg_t*) next;
 };
@@ -81,6 +82,15 @@ typedef struct pony_msgfunc_t
     void (*func)(void * message);
 } pony_msgfunc_t;
 
+/// Message whose argument is stored inline, directly after it, rather than
+/// behind a pointer. The header is padded so the payload is 16 byte aligned.
+typedef struct pony_msginline_t
+{
+    pony_msg_t msg;
+    void (*func)(void * payload);
+    void* pad;
+} pony_msginline_t;
+
 /// Convenience message for sending remote message.
 typedef struct pony_msg_remote_version_t
 {
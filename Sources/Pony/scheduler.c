@@ -5,8 +5,10 @@
 
 #define PONY_WANT_ATOMIC_DEFS
 
+#include "pony.h"
 #include "scheduler.h"
 #include "mpmcq.h"
+#include "deque.h"
 #include "pagemap.h"
 #include "memory.h"
 #include "cpu.h"
@@ -19,6 +21,25 @@
 
 #define PONY_PROFILE_MAX_TYPES 1024
 
+// Lanes are strict: a lower one only runs once every higher one is empty. So
+// that a steady stream of high priority work cannot shut the rest out
+// entirely, every this many pops a scheduler serves its lanes lowest first.
+#define PONY_SCHED_LANE_STARVATION_INTERVAL 32
+
+// Upper bound on how many actors a single visit to a victim may move. Half the
+// victim's queue is taken, up to this many. FLYNN_STEAL_BATCH overrides it.
+#define PONY_SCHED_STEAL_BATCH_MAX 32
+#define PONY_SCHED_STEAL_BATCH_LIMIT 1024
+
+// Longest an idle scheduler will spin before parking. FLYNN_SPIN_MAX_US
+// overrides it; 0 parks at once.
+#define PONY_SCHED_SPIN_MAX_US 20
+#define PONY_SCHED_SPIN_LIMIT_US 10000
+
+// Bounds on the park backstop; see steal().
+#define PONY_SCHED_PARK_TIMEOUT_MIN_US 1000
+#define PONY_SCHED_PARK_TIMEOUT_MAX_US 100000
+
 typedef struct prof_bucket_t { uint64_t ns; uint64_t count; } prof_bucket_t;
 
 static prof_bucket_t* g_prof = NULL;
@@ -45,10 +66,29 @@ static DECLARE_THREAD_FN(run_thread);
 
 // Scheduler global data.
 static uint32_t scheduler_count;
-static PONY_ATOMIC(uint32_t) active_scheduler_count;
-static PONY_ATOMIC(uint32_t) active_scheduler_count_check;
 static scheduler_t* scheduler;
 
+// Elastic scheduling. Schedulers [0, active_scheduler_count) are active; the
+// rest are suspended. Only the highest active scheduler may suspend itself,
+// once it has found no work for suspend_after_ns, and never below
+// min_active_count. While nobody is parked, the lowest suspended scheduler is
+// revived once revive_backlog actors are waiting: either on a busy
+// scheduler's own queue, or on the inject queues, which is where everything
+// sent from threads that are not schedulers waits. The two thresholds are the
+// hysteresis: a scheduler is not revived just to find nothing and suspend
+// again. With min_active_count == scheduler_count, the default, nothing is
+// ever suspended.
+#define PONY_SCHED_SUSPEND_AFTER_MS 100
+#define PONY_SCHED_REVIVE_BACKLOG 4
+#define PONY_SCHED_SUSPEND_BACKSTOP_US 1000000
+
+static PONY_ATOMIC(uint32_t) active_scheduler_count;
+static uint32_t min_active_count;
+static uint64_t suspend_after_ns;
+static int64_t revive_backlog;
+static int64_t steal_batch_max = PONY_SCHED_STEAL_BATCH_MAX;
+static uint64_t spin_max_ns = PONY_SCHED_SPIN_MAX_US * 1000;
+
 void pony_profiler_reset(void)
 {
     if (g_prof == NULL) { return; }
@@ -75,9 +115,56 @@ int pony_profiler_collect(uint64_t* outNs, uint64_t* outCount, int maxTypes)
     }
     return n;
 }
-static mpmcq_t inject;
-static mpmcq_t injectHighPerformance;
-static mpmcq_t injectHighEfficiency;
+
+int pony_scheduler_count(void)
+{
+    return (int)scheduler_count;
+}
+
+int pony_active_scheduler_count(void)
+{
+    return (int)atomic_load_explicit(&active_scheduler_count, memory_order_relaxed);
+}
+
+int pony_steal_batch_max(void)
+{
+    return (int)steal_batch_max;
+}
+
+int pony_spin_max_us(void)
+{
+    return (int)(spin_max_ns / 1000);
+}
+
+int pony_scheduler_stats(pony_scheduler_stats_t* outStats, int maxSchedulers)
+{
+    // The counters are written only by their owning scheduler and read here
+    // without synchronisation, the same as the profiler buckets. A sample can
+    // be a little behind; it is never torn on the platforms we support.
+    int n = maxSchedulers < (int)scheduler_count ? maxSchedulers : (int)scheduler_count;
+    if (scheduler == NULL) { return 0; }
+    for (int s = 0; s < n; s++) {
+        outStats[s].steals = scheduler[s].steals;
+        outStats[s].stolen_actors = scheduler[s].stolen_actors;
+        outStats[s].largest_steal = scheduler[s].largest_steal;
+        outStats[s].spin_hits = scheduler[s].spin_hits;
+        outStats[s].parks = scheduler[s].parks;
+        outStats[s].idle_gap_ns = scheduler[s].idle_gap_ns;
+        outStats[s].spin_ns = scheduler[s].spin_ns;
+    }
+    return n;
+}
+
+// One of each inject queue per lane.
+static mpmcq_t inject[PONY_SCHED_LANES];
+static mpmcq_t injectHighPerformance[PONY_SCHED_LANES];
+static mpmcq_t injectHighEfficiency[PONY_SCHED_LANES];
+
+// Actors pushed onto inject by threads that are not schedulers and not yet
+// taken off, per lane. The queues keep no count of their own. pop_inject()
+// takes a queue whole, so it zeroes its lane rather than counting down; this
+// only has to tell a backlog from a trickle.
+static PONY_ATOMIC(int64_t) inject_backlog[PONY_SCHED_LANES];
 
 // Cleared before the scheduler array is torn down. wake_one_sleeper() can be
 // called from threads that are not schedulers -- the timer loop, remote node
@@ -86,6 +173,26 @@ static mpmcq_t injectHighEfficiency;
 // freed scheduler_t memory and lock a destroyed mutex.
 static PONY_ATOMIC(bool) schedulers_running;
 
+// Quiescence. Every time an actor is made runnable it is counted once, by the
+// scheduler that did it or, for threads that are not schedulers, in
+// external_scheduled; every time a scheduler runs one and does not put it back
+// it is counted once more in unscheduled. When the two totals agree nothing is
+// queued or running anywhere. ponyint_sched_wait() parks on quiescence_park
+// and every scheduler that is about to park wakes it to take another look.
+static PONY_ATOMIC(uint64_t) external_scheduled;
+static PONY_ATOMIC(bool) quiescence_waiting;
+static pony_park_t quiescence_park;
+
+// Backstop for the one thing no scheduler reports: remotes going away.
+#define QUIESCENCE_BACKSTOP_US 10000
+
+static inline void sched_count(PONY_ATOMIC(uint64_t)* counter)
+{
+    // Only the owning scheduler writes its counters.
+    uint64_t n = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, n + 1, memory_order_release);
+}
+
 // Number of schedulers currently parked. Read on every push, so the common
 // loaded case -- nobody parked -- costs a single load of a line that stays
 // shared across cores rather than a scan.
@@ -161,11 +268,35 @@ uint32_t get_active_scheduler_count()
 }
 
 /**
- * Gets the next actor from the scheduler queue.
+ * The lane an actor is queued in, from its priority.
+ */
+static inline int sched_lane(pony_actor_t* actor)
+{
+    if(actor->priority < PONY_DEFAULT_ACTOR_PRIORITY)
+        return 0;
+    if(actor->priority > PONY_DEFAULT_ACTOR_PRIORITY)
+        return 2;
+    return 1;
+}
+
+/**
+ * Actors waiting on a scheduler's queue, across all of its lanes.
  */
-static pony_actor_t* pop(scheduler_t* sched)
+static int64_t sched_queued(scheduler_t* sched)
 {
-    return ponyint_mpmcq_pop(&sched->q);
+    int64_t n = 0;
+    for(int lane = 0; lane < PONY_SCHED_LANES; lane++)
+        n += ponyint_deque_num_messages(&sched->q[lane]);
+    return n;
+}
+
+/**
+ * Gets the next actor from one lane of the scheduler queue. Only the owning
+ * scheduler may call this.
+ */
+static pony_actor_t* pop(scheduler_t* sched, int lane)
+{
+    return (pony_actor_t*)ponyint_deque_pop(&sched->q[lane]);
 }
 
 /**
@@ -173,14 +304,16 @@ static pony_actor_t* pop(scheduler_t* sched)
  */
 static void push(scheduler_t* sched, pony_actor_t* actor)
 {
+    int lane = sched_lane(actor);
+    
     switch (actor->coreAffinity) {
         case kCoreAffinity_OnlyPerformance:
         case kCoreAffinity_OnlyEfficiency:
             if (actor->coreAffinity != sched->coreAffinity) {
                 if (actor->coreAffinity == kCoreAffinity_OnlyPerformance) {
-                    ponyint_mpmcq_push(&injectHighPerformance, actor);
+                    ponyint_mpmcq_push(&injectHighPerformance[lane], actor);
                 } else {
-                    ponyint_mpmcq_push(&injectHighEfficiency, actor);
+                    ponyint_mpmcq_push(&injectHighEfficiency[lane], actor);
                 }
                 // actor->coreAffinity is already exactly the class that can pop
                 // the queue we just pushed to.
@@ -190,82 +323,249 @@ static void push(scheduler_t* sched, pony_actor_t* actor)
             break;
         case kCoreAffinity_PreferEfficiency:
             if (sched->coreAffinity == kCoreAffinity_OnlyPerformance) {
-                ponyint_mpmcq_push(&injectHighEfficiency, actor);
+                ponyint_mpmcq_push(&injectHighEfficiency[lane], actor);
                 wake_one_sleeper(kCoreAffinity_OnlyEfficiency);
                 return;
             }
             break;
         case kCoreAffinity_PreferPerformance:
             if (sched->coreAffinity == kCoreAffinity_OnlyEfficiency) {
-                ponyint_mpmcq_push(&injectHighPerformance, actor);
+                ponyint_mpmcq_push(&injectHighPerformance[lane], actor);
                 wake_one_sleeper(kCoreAffinity_OnlyPerformance);
                 return;
             }
             break;
     }
     // Our own queue: stealable by any scheduler, and push() has already routed
-    // away anything incompatible with sched, so any sleeper will do.
-    ponyint_mpmcq_push_single(&sched->q, actor);
+    // away anything incompatible with sched, so any sleeper will do. If the
+    // deque is full the actor spills to the global inject queue instead, which
+    // every scheduler drains first.
+    if(!ponyint_deque_push(&sched->q[lane], actor))
+        ponyint_mpmcq_push(&inject[lane], actor);
     wake_one_sleeper(kCoreAffinity_None);
 }
 
 /**
- * Handles the global queue and then pops from the local queue
+ * Takes up to half of one lane of another scheduler's queue in one visit. The
+ * oldest actor is returned to run; the rest are moved onto our own queue, where
+ * they are ours to run next and any other idle scheduler's to steal in turn.
  */
-static pony_actor_t* pop_global(scheduler_t* my_sched, scheduler_t* other_sched)
+static pony_actor_t* steal_from(scheduler_t* sched, scheduler_t* victim, int lane)
 {
-    pony_actor_t* actor = (pony_actor_t*)ponyint_mpmcq_pop(&inject);
+    pony_actor_t* actor = (pony_actor_t*)ponyint_deque_steal(&victim->q[lane]);
+    
+    if(actor == NULL)
+        return NULL;
+    
+    // The deque only supports taking one item per CAS, so a batch is a run of
+    // single steals. What it saves is the trip back through the spin/park loop
+    // in steal() for every actor, which is where the time went.
+    int64_t batch = (ponyint_deque_num_messages(&victim->q[lane]) + 2) / 2;
+    if(batch > steal_batch_max)
+        batch = steal_batch_max;
+    
+    int64_t moved = 1;
+    while(moved < batch)
+    {
+        pony_actor_t* next = (pony_actor_t*)ponyint_deque_steal(&victim->q[lane]);
+        if(next == NULL)
+            break;
+        
+        moved++;
+        
+        if(COREAFFINITY_IS_INCOMPATIBLE(next->coreAffinity, sched->coreAffinity)) {
+            push(sched, next);
+            continue;
+        }
+        // An actor's priority can change while it is queued, so its lane is
+        // looked up again rather than assumed to be the one it came from.
+        int next_lane = sched_lane(next);
+        if(!ponyint_deque_push(&sched->q[next_lane], next))
+            ponyint_mpmcq_push(&inject[next_lane], next);
+    }
+    
+    // We are holding more than we can run right now; let one sleeper come and
+    // take some of it off us.
+    if(moved > 1)
+        wake_one_sleeper(kCoreAffinity_None);
+    
+    sched->steals++;
+    sched->stolen_actors += (uint64_t)moved;
+    if((uint64_t)moved > sched->largest_steal)
+        sched->largest_steal = (uint64_t)moved;
+    
+    return actor;
+}
+
+/**
+ * Takes everything on an inject queue in one exchange. The oldest actor is
+ * returned to run; the rest are moved onto our own queue, the same as a steal
+ * batch, where any other idle scheduler can take them in turn.
+ */
+static pony_actor_t* pop_inject(scheduler_t* sched, mpmcq_t* q, PONY_ATOMIC(int64_t)* backlog)
+{
+    pony_actor_t* actor = (pony_actor_t*)ponyint_mpmcq_pop_all(q);
+    
+    if(actor == NULL)
+        return NULL;
+    
+    if(backlog != NULL)
+        atomic_store_explicit(backlog, 0, memory_order_relaxed);
+    
+    pony_actor_t* next = (pony_actor_t*)ponyint_mpmcq_next(q, actor);
+    if(next == NULL)
+        return actor;
+    
+    bool spilled = false;
+    while(next != NULL)
+    {
+        pony_actor_t* following = (pony_actor_t*)ponyint_mpmcq_next(q, next);
+        
+        if(COREAFFINITY_IS_INCOMPATIBLE(next->coreAffinity, sched->coreAffinity)) {
+            push(sched, next);
+        } else if(spilled || !ponyint_deque_push(&sched->q[sched_lane(next)], next)) {
+            // Our queue is full; the rest goes back for another scheduler.
+            spilled = true;
+            ponyint_mpmcq_push(q, next);
+        }
+        
+        next = following;
+    }
+    
+    wake_one_sleeper(kCoreAffinity_None);
+    return actor;
+}
+
+/**
+ * Picks the nearest scheduler with something to steal from the given lane.
+ * Whoever we last stole from is tried first for as long as it still has work,
+ * since whatever it has left is likely related to what we just took. Returns
+ * NULL if nobody has work in that lane.
+ */
+static scheduler_t* choose_victim(scheduler_t* sched, int lane)
+{
+    if (sched == NULL || sched->victims == NULL) {
+        return NULL;
+    }
+    
+    scheduler_t* last = sched->last_victim;
+    if (last != NULL && last != sched && ponyint_deque_num_messages(&last->q[lane]) > 0) {
+        return last;
+    }
+    
+    for (uint32_t i = 0; i < scheduler_count - 1; i++) {
+        scheduler_t* victim = sched->victims[i];
+        if (ponyint_deque_num_messages(&victim->q[lane]) > 0) {
+            sched->last_victim = victim;
+            return victim;
+        }
+    }
+    
+    return NULL;
+}
+
+/**
+ * Handles one lane: the global queues, then the local queue, then, if allowed,
+ * the nearest victim's queue.
+ */
+static pony_actor_t* pop_lane(scheduler_t* sched, int lane, bool may_steal)
+{
+    pony_actor_t* actor = pop_inject(sched, &inject[lane], &inject_backlog[lane]);
     
     if(actor != NULL)
         return actor;
     
-    switch (my_sched->coreAffinity) {
+    switch (sched->coreAffinity) {
         case kCoreAffinity_OnlyPerformance:
-            actor = (pony_actor_t*)ponyint_mpmcq_pop(&injectHighPerformance);
+            actor = pop_inject(sched, &injectHighPerformance[lane], NULL);
             break;
         case kCoreAffinity_OnlyEfficiency:
-            actor = (pony_actor_t*)ponyint_mpmcq_pop(&injectHighEfficiency);
+            actor = pop_inject(sched, &injectHighEfficiency[lane], NULL);
             break;
     }
     if(actor != NULL)
         return actor;
     
-    if (other_sched != NULL)
-        return pop(other_sched);
+    actor = pop(sched, lane);
+    if(actor != NULL || !may_steal)
+        return actor;
+    
+    scheduler_t* victim = choose_victim(sched, lane);
+    if(victim != NULL)
+        return steal_from(sched, victim, lane);
     return NULL;
 }
 
-static scheduler_t* choose_victim(scheduler_t* sched)
+/**
+ * Gets the next actor to run, highest lane first, so that an actor above the
+ * default priority found on any queue -- even another scheduler's, when
+ * stealing -- runs ahead of every default one. Every
+ * PONY_SCHED_LANE_STARVATION_INTERVAL pops the lanes are tried lowest first
+ * instead, and that pass may always steal: schedulers busy with high lanes
+ * never go idle to steal, so without it starved work would stay wherever it
+ * was queued, at the pace of a single scheduler.
+ */
+static pony_actor_t* pop_global(scheduler_t* sched, bool may_steal)
 {
-    if (sched == NULL) {
-        return NULL;
+    bool lowest_first = (++sched->lane_pops % PONY_SCHED_LANE_STARVATION_INTERVAL) == 0;
+    
+    for(int i = 0; i < PONY_SCHED_LANES; i++)
+    {
+        int lane = lowest_first ? i : PONY_SCHED_LANES - 1 - i;
+        pony_actor_t* actor = pop_lane(sched, lane, may_steal || lowest_first);
+        if(actor != NULL)
+            return actor;
     }
     
-    // we have work to do or the global inject does, we can return right away
-    if(sched->last_victim != NULL && sched->last_victim->q.num_messages > 0) {
-        return sched->last_victim;
+    if(may_steal)
+        sched->last_victim = sched;
+    return NULL;
+}
+
+/**
+ * Places each scheduler on a cpu and orders every other scheduler by how far
+ * away its cpu is: SMT sibling, then shared last level cache, then same node,
+ * then remote. Ties are broken by rotating from our own index, so that
+ * equidistant thieves do not all descend on the same victim.
+ */
+static void sched_build_victims(void)
+{
+    bool hybrid = ponyint_hybrid_cores_enabled() != 0;
+    uint32_t nth_e = 0, nth_p = 0, nth_any = 0;
+    
+    for(uint32_t i = 0; i < scheduler_count; i++)
+    {
+        if (!hybrid) {
+            scheduler[i].cpu = ponyint_cpu_for_scheduler(kCoreAffinity_None, nth_any++);
+        } else if (scheduler[i].coreAffinity == kCoreAffinity_OnlyEfficiency) {
+            scheduler[i].cpu = ponyint_cpu_for_scheduler(kCoreAffinity_OnlyEfficiency, nth_e++);
+        } else {
+            scheduler[i].cpu = ponyint_cpu_for_scheduler(kCoreAffinity_OnlyPerformance, nth_p++);
+        }
     }
     
-    scheduler_t* victim = sched->last_victim;
-    while(true)
+    for(uint32_t i = 0; i < scheduler_count; i++)
     {
-        victim--;
+        scheduler_t** victims = (scheduler_t**)ponyint_pool_alloc((scheduler_count - 1) * sizeof(scheduler_t*));
+        uint32_t n = 0;
         
-        if(victim < scheduler)
-            victim = &scheduler[scheduler_count - 1];
-        
-        if((victim == sched->last_victim) || (scheduler_count == 1)) {
-            sched->last_victim = sched;
-            break;
-        }
-        if(victim == sched) {
-            continue;
+        for(uint32_t k = 1; k < scheduler_count; k++)
+        {
+            scheduler_t* candidate = &scheduler[(i + k) % scheduler_count];
+            uint32_t distance = ponyint_cpu_distance(scheduler[i].cpu, candidate->cpu);
+            
+            // Insertion sort; stable, so rotation order survives within a tier.
+            uint32_t at = n;
+            while(at > 0 && ponyint_cpu_distance(scheduler[i].cpu, victims[at - 1]->cpu) > distance) {
+                victims[at] = victims[at - 1];
+                at--;
+            }
+            victims[at] = candidate;
+            n++;
         }
-        sched->last_victim = victim;
-        return victim;
+        
+        scheduler[i].victims = victims;
     }
-    
-    return NULL;
 }
 
 void check_memory_usage(scheduler_t* sched) {
@@ -280,23 +580,26 @@ void check_memory_usage(scheduler_t* sched) {
 
 static bool work_available(scheduler_t* sched)
 {
-    if(ponyint_mpmcq_num_messages(&inject) > 0)
-        return true;
+    for(int lane = 0; lane < PONY_SCHED_LANES; lane++)
+    {
+        if(!ponyint_mpmcq_is_empty(&inject[lane]))
+            return true;
 
-    switch(sched->coreAffinity) {
-        case kCoreAffinity_OnlyPerformance:
-            if(ponyint_mpmcq_num_messages(&injectHighPerformance) > 0)
-                return true;
-            break;
-        case kCoreAffinity_OnlyEfficiency:
-            if(ponyint_mpmcq_num_messages(&injectHighEfficiency) > 0)
-                return true;
-            break;
+        switch(sched->coreAffinity) {
+            case kCoreAffinity_OnlyPerformance:
+                if(!ponyint_mpmcq_is_empty(&injectHighPerformance[lane]))
+                    return true;
+                break;
+            case kCoreAffinity_OnlyEfficiency:
+                if(!ponyint_mpmcq_is_empty(&injectHighEfficiency[lane]))
+                    return true;
+                break;
+        }
     }
 
     for(uint32_t i = 0; i < scheduler_count; i++)
     {
-        if(ponyint_mpmcq_num_messages(&scheduler[i].q) > 0)
+        if(sched_queued(&scheduler[i]) > 0)
             return true;
     }
 
@@ -310,6 +613,11 @@ static void park_scheduler(scheduler_t* sched, uint64_t timeout_us)
 
     atomic_thread_fence(memory_order_seq_cst);
 
+    // Pairs with the fence in ponyint_sched_wait(): either it sees the actors
+    // we stopped running, or we see that it is waiting.
+    if(atomic_load_explicit(&quiescence_waiting, memory_order_relaxed))
+        ponyint_park_wake(&quiescence_park);
+
     if(work_available(sched) == false && atomic_load_explicit(&sched->terminate, memory_order_relaxed) == false)
         ponyint_park_wait(&sched->park, timeout_us);
 
@@ -318,65 +626,170 @@ static void park_scheduler(scheduler_t* sched, uint64_t timeout_us)
 }
 
 /**
- * Use mpmcqs to allow stealing directly from a victim, without waiting for a
- * response.
+ * Suspends sched if it is the highest active scheduler and that would not take
+ * us below the minimum. Returns once it has been revived, or straight away if
+ * it may not suspend.
+ */
+static void sched_suspend(scheduler_t* sched)
+{
+    uint32_t active = atomic_load_explicit(&active_scheduler_count, memory_order_relaxed);
+    if(active <= min_active_count || (uint32_t)sched->index != active - 1)
+        return;
+    
+    // Publish suspended before giving up our slot: sched_revive() can only take
+    // the slot back after that, so its clear can never be overwritten by us.
+    atomic_store_explicit(&sched->suspended, true, memory_order_seq_cst);
+    if(!atomic_compare_exchange_strong_explicit(&active_scheduler_count, &active, active - 1,
+                                                memory_order_acq_rel, memory_order_relaxed))
+    {
+        atomic_store_explicit(&sched->suspended, false, memory_order_relaxed);
+        return;
+    }
+    
+    // Our own deque is empty -- only we push to it, and we just found nothing
+    // -- and the inject queues are drained by whoever is still active, so
+    // nothing is stranded while we are gone.
+    while(atomic_load_explicit(&sched->suspended, memory_order_acquire) &&
+          atomic_load_explicit(&sched->terminate, memory_order_relaxed) == false)
+        ponyint_park_wait(&sched->park, PONY_SCHED_SUSPEND_BACKSTOP_US);
+}
+
+/**
+ * Brings back the lowest suspended scheduler, if there is one.
+ */
+static void sched_revive(void)
+{
+    uint32_t active = atomic_load_explicit(&active_scheduler_count, memory_order_relaxed);
+    if(active >= scheduler_count)
+        return;
+    
+    if(!atomic_compare_exchange_strong_explicit(&active_scheduler_count, &active, active + 1,
+                                                memory_order_acq_rel, memory_order_relaxed))
+        return;
+    
+    scheduler_t* revived = &scheduler[active];
+    atomic_store_explicit(&revived->suspended, false, memory_order_release);
+    ponyint_park_wake(&revived->park);
+}
+
+/**
+ * Called by a busy scheduler between actors, and with a NULL sched by threads
+ * that are not schedulers after they inject work. Cheap unless some scheduler
+ * is suspended.
+ */
+static void sched_check_load(scheduler_t* sched)
+{
+    if(atomic_load_explicit(&active_scheduler_count, memory_order_relaxed) >= scheduler_count)
+        return;
+    
+    if(atomic_load_explicit(&sleeping_count, memory_order_relaxed) != 0)
+        return;
+    
+    int64_t queued = (sched != NULL) ? sched_queued(sched) : 0;
+    for(int lane = 0; lane < PONY_SCHED_LANES; lane++)
+        queued += atomic_load_explicit(&inject_backlog[lane], memory_order_relaxed);
+    
+    if(queued >= revive_backlog)
+        sched_revive();
+}
+
+/**
+ * Called when an idle period ends in work, gap_ns after it began. Keeps a
+ * running average of the gap and spins for about twice that next time, as
+ * long as that fits within spin_max_ns: work that shows up that soon is
+ * cheaper to wait for than a park/wake round trip. When the typical gap is
+ * longer, spinning would only burn the cpu before parking anyway, so we park
+ * at once. Gaps that end in a park are still measured, which is what lets a
+ * scheduler that stopped spinning notice the work has started coming faster.
+ */
+static void sched_adapt_spin(scheduler_t* sched, uint64_t gap_ns, bool parked)
+{
+    if (parked) {
+        sched->parks++;
+    } else {
+        sched->spin_hits++;
+    }
+    
+    // A suspended scheduler can be idle for minutes; do not let one such
+    // period swamp the average.
+    if (gap_ns > PONY_SCHED_PARK_TIMEOUT_MAX_US * 1000) {
+        gap_ns = PONY_SCHED_PARK_TIMEOUT_MAX_US * 1000;
+    }
+    sched->idle_gap_ns = sched->idle_gap_ns - sched->idle_gap_ns / 8 + gap_ns / 8;
+    
+    uint64_t target = sched->idle_gap_ns * 2;
+    sched->spin_ns = (target <= spin_max_ns) ? target : 0;
+}
+
+/**
+ * Use work stealing deques to allow stealing directly from a victim, without
+ * waiting for a response.
  */
 static pony_actor_t* steal(scheduler_t* sched)
 {
     pony_actor_t* actor = NULL;
-    scheduler_t* victim = NULL;
 
     // Backoff policy for a scheduler that has run out of work.
     //
-    // Spin briefly first: work often shows up within a few hundred nanoseconds,
-    // and a park/unpark round trip costs far more than the spin does. Past that
-    // we park, which unlike a sleep can be woken the moment work is pushed.
+    // Spin first, for as long as sched_adapt_spin() has found it pays: when
+    // work typically shows up within a few microseconds a park/unpark round
+    // trip costs far more than the spin does. Past that we park, which unlike
+    // a sleep can be woken the moment work is pushed.
     //
     // The timeout is a backstop, not the discovery mechanism -- a parked
-    // scheduler is woken by wake_one_sleeper(), so wake latency no longer has
-    // anything to do with how long we are willing to sleep for. That decoupling
-    // is the point: the previous exponential sleep had to trade idle CPU
-    // against wake latency, and could not give both.
-    const int spin_rounds = 12;
-    const uint64_t park_timeout_min = 1000;      // us
-    const uint64_t park_timeout_max = 100000;    // us
-
-    int spins = 0;
+    // scheduler is woken by wake_one_sleeper(), so wake latency has nothing to
+    // do with how long we are willing to sleep for. It starts at the typical
+    // idle gap, so a scheduler whose work arrives every few tens of
+    // milliseconds is not pointlessly woken on the way there, and doubles from
+    // there so that a missed wakeup is still caught quickly.
+    uint64_t idle_start = ponyint_cpu_tick();
+    bool parked = false;
     uint64_t park_timeout = 0;
+    uint64_t idle_since = 0;
     
     while(true)
     {
-        // Choose the victim with the most work to do
-        victim = choose_victim(sched);
+        // Our own queue and the inject queues first, then the nearest victim
+        // with work to do, lane by lane.
+        actor = pop_global(sched, true);
         
-        if (victim != NULL) {
-            actor = pop_global(sched, victim);
-            
-            // If we stole the wrong actor, throw it back in the sea
-            if (actor != NULL && COREAFFINITY_IS_INCOMPATIBLE(actor->coreAffinity, sched->coreAffinity)) {
-                push(sched, actor);
-                actor = NULL;
-            }
-            
-            if(actor != NULL)
-                break;
+        // If we stole the wrong actor, throw it back in the sea
+        if (actor != NULL && COREAFFINITY_IS_INCOMPATIBLE(actor->coreAffinity, sched->coreAffinity)) {
+            push(sched, actor);
+            actor = NULL;
         }
         
-        if (spins < spin_rounds) {
-            spins++;
-        } else {
+        if(actor != NULL)
+            break;
+        
+        if (parked || ponyint_cpu_tick() - idle_start >= sched->spin_ns) {
+            parked = true;
+            
             // Sample memory on the same throttle the busy path in run() uses.
             check_memory_usage(sched);
 
-            // Ramp the backstop rather than jumping straight to the maximum, so
-            // that if a wakeup is ever missed it is caught in a millisecond
-            // rather than a tenth of a second.
-            park_timeout = (park_timeout == 0) ? park_timeout_min : park_timeout * 2;
-            if (park_timeout > park_timeout_max) {
-                park_timeout = park_timeout_max;
+            if (park_timeout == 0) {
+                park_timeout = sched->idle_gap_ns / 1000;
+                if (park_timeout < PONY_SCHED_PARK_TIMEOUT_MIN_US) {
+                    park_timeout = PONY_SCHED_PARK_TIMEOUT_MIN_US;
+                }
+            } else {
+                park_timeout *= 2;
+            }
+            if (park_timeout > PONY_SCHED_PARK_TIMEOUT_MAX_US) {
+                park_timeout = PONY_SCHED_PARK_TIMEOUT_MAX_US;
             }
 
             park_scheduler(sched, park_timeout);
+            
+            uint64_t now = ponyint_cpu_tick();
+            if (idle_since == 0) {
+                idle_since = now;
+            } else if (now - idle_since >= suspend_after_ns) {
+                sched_suspend(sched);
+                idle_since = 0;
+                park_timeout = 0;
+            }
         }
         
         if (atomic_load_explicit(&sched->terminate, memory_order_relaxed)) {
@@ -388,6 +801,8 @@ static pony_actor_t* steal(scheduler_t* sched)
     
     atomic_store_explicit(&sched->idle, false, memory_order_relaxed);
     
+    sched_adapt_spin(sched, ponyint_cpu_tick() - idle_start, parked);
+    
     return actor;
 }
 
@@ -396,7 +811,7 @@ static pony_actor_t* steal(scheduler_t* sched)
  */
 static void run(scheduler_t* sched)
 {
-    pony_actor_t* actor = pop_global(sched, sched);
+    pony_actor_t* actor = pop_global(sched, false);
     
 #ifdef PLATFORM_IS_APPLE
     autorelease_pool = objc_autoreleasePoolPush();
@@ -405,9 +820,10 @@ static void run(scheduler_t* sched)
     while(true) {
         
         check_memory_usage(sched);
+        sched_check_load(sched);
         
         if(actor == NULL) {
-            actor = pop_global(sched, sched);
+            actor = pop_global(sched, false);
         }
         if(actor == NULL) {
             actor = steal(sched);
@@ -435,6 +851,9 @@ static void run(scheduler_t* sched)
             uint64_t profStart  = profOn ? ponyint_cpu_tick() : 0;
 
             int result = ponyint_actor_run(&sched->ctx, actor, actor->batchSize);
+            
+            if(result != 1)
+                sched_count(&sched->unscheduled);
 
             if (profOn && g_prof != NULL && profTypeID >= 0 && profTypeID < PONY_PROFILE_MAX_TYPES) {
                 prof_bucket_t* b = &g_prof[(size_t)sched->index * PONY_PROFILE_MAX_TYPES + profTypeID];
@@ -442,7 +861,7 @@ static void run(scheduler_t* sched)
                 b->count += 1;
             }
                         
-            pony_actor_t* next = pop_global(sched, sched);
+            pony_actor_t* next = pop_global(sched, false);
             
 #ifdef PLATFORM_IS_APPLE
             autorelease_pool_is_dirty = true;
@@ -453,10 +872,12 @@ static void run(scheduler_t* sched)
                     atomic_load_explicit(&actor->yield, memory_order_relaxed);
                 
                 if(next != NULL) {
-                    if (actor_did_yield == false && actor->priority > next->priority) {
+                    if (actor_did_yield == false && sched_lane(actor) == sched_lane(next) &&
+                        actor->priority > next->priority) {
                         // our current actor has a higher priority than the next actor, so put
                         // the next actor back at the end of our queue.  Hopefully someone
-                        // else will pick him up
+                        // else will pick him up. Across lanes pop_global() has already made
+                        // this call, and overruling it would undo its starvation protection.
                         push(sched, next);
                     }else{
                         // If we have a next actor, we go on the back of the queue. Otherwise,
@@ -506,6 +927,7 @@ static DECLARE_THREAD_FN(run_thread)
     
     ponyint_thead_setname(sched->index, sched->coreAffinity);
     ponyint_cpu_apply_thread_affinity(sched->coreAffinity);
+    ponyint_cpu_pin_scheduler(sched->cpu);
     
     run(sched);
     ponyint_pool_thread_cleanup();
@@ -541,8 +963,12 @@ static void ponyint_sched_shutdown()
     {
         while(ponyint_thread_messageq_pop(&scheduler[i].mq) != NULL) { ; }
         ponyint_messageq_destroy(&scheduler[i].mq);
-        ponyint_mpmcq_destroy(&scheduler[i].q);
+        for(int lane = 0; lane < PONY_SCHED_LANES; lane++)
+            ponyint_deque_destroy(&scheduler[i].q[lane]);
         ponyint_park_destroy(&scheduler[i].park);
+        if (scheduler[i].victims != NULL) {
+            ponyint_pool_free(scheduler[i].victims, (scheduler_count - 1) * sizeof(scheduler_t*));
+        }
     }
     
     ponyint_pool_free(scheduler, scheduler_count * sizeof(scheduler_t));
@@ -557,26 +983,42 @@ static void ponyint_sched_shutdown()
     atomic_store_explicit(&active_scheduler_count, 0, memory_order_relaxed);
     atomic_store_explicit(&sleeping_count, 0, memory_order_relaxed);
     
-    ponyint_mpmcq_destroy(&inject);
-    ponyint_mpmcq_destroy(&injectHighEfficiency);
-    ponyint_mpmcq_destroy(&injectHighPerformance);
+    for(int lane = 0; lane < PONY_SCHED_LANES; lane++)
+    {
+        ponyint_mpmcq_destroy(&inject[lane]);
+        ponyint_mpmcq_destroy(&injectHighEfficiency[lane]);
+        ponyint_mpmcq_destroy(&injectHighPerformance[lane]);
+        atomic_store_explicit(&inject_backlog[lane], 0, memory_order_relaxed);
+    }
+    ponyint_park_destroy(&quiescence_park);
     
     //pony_syslog2("Flynn", "max memory usage: %0.2f MB\n", ponyint_max_memory() / (1024.0f * 1024.0f));
 }
 
-pony_ctx_t* ponyint_sched_init(int force_scheduler_count, int minimum_scheduler_count)
+pony_ctx_t* ponyint_sched_init(int force_scheduler_count, int minimum_scheduler_count,
+                               int minimum_active_count, int suspend_after_ms, int revive_backlog_actors)
 {
     pony_register_thread();
     
-    uint32_t threads = ponyint_core_count();
+    // Size from the cpus we may actually use rather than the ones we can see;
+    // in a container with a cpu quota the difference is all throttling.
+    uint32_t threads = ponyint_cpu_budget();
     
+    // The default floor of 4 keeps small machines responsive when an actor
+    // blocks, but under a quota the extra threads only burn the budget sooner.
+    // There we floor at 2, enough for one blocked actor; a caller asking for
+    // 4 or more still gets it either way.
     if (minimum_scheduler_count < 4) {
-        minimum_scheduler_count = 4;
+        if (threads < ponyint_core_count()) {
+            minimum_scheduler_count = threads < 2 ? 2 : (threads > 4 ? 4 : (int)threads);
+        } else {
+            minimum_scheduler_count = 4;
+        }
     }
     
     scheduler_count = threads;
     if (scheduler_count < minimum_scheduler_count) {
-        pony_syslog2("Flynn", "Minimum scheduler count of %d activated (only %d hardware cores available)", minimum_scheduler_count, threads);
+        pony_syslog2("Flynn", "Minimum scheduler count of %d activated (only %d cpus available)", minimum_scheduler_count, threads);
         scheduler_count = minimum_scheduler_count;
     }
     
@@ -594,8 +1036,44 @@ pony_ctx_t* ponyint_sched_init(int force_scheduler_count, int minimum_scheduler_
         scheduler_count = 2;
     }
     
+    const char * batch = getenv("FLYNN_STEAL_BATCH");
+    steal_batch_max = PONY_SCHED_STEAL_BATCH_MAX;
+    if (batch != NULL) {
+        long requested = strtol(batch, NULL, 10);
+        if (requested < 1) {
+            requested = 1;
+        }
+        if (requested > PONY_SCHED_STEAL_BATCH_LIMIT) {
+            requested = PONY_SCHED_STEAL_BATCH_LIMIT;
+        }
+        steal_batch_max = requested;
+        pony_syslog2("Flynn", "steal batch limit set to %ld by FLYNN_STEAL_BATCH", requested);
+    }
+    
+    const char * spin = getenv("FLYNN_SPIN_MAX_US");
+    spin_max_ns = PONY_SCHED_SPIN_MAX_US * 1000;
+    if (spin != NULL) {
+        long requested = strtol(spin, NULL, 10);
+        if (requested < 0) {
+            requested = 0;
+        }
+        if (requested > PONY_SCHED_SPIN_LIMIT_US) {
+            requested = PONY_SCHED_SPIN_LIMIT_US;
+        }
+        spin_max_ns = (uint64_t)requested * 1000;
+        pony_syslog2("Flynn", "spin limit set to %ldus by FLYNN_SPIN_MAX_US", requested);
+    }
+    
+    // ponyint_sched_start() raises this further, once it knows how many
+    // efficiency schedulers there are.
+    min_active_count = scheduler_count;
+    if (minimum_active_count > 0 && (uint32_t)minimum_active_count < scheduler_count) {
+        min_active_count = minimum_active_count;
+    }
+    suspend_after_ns = (uint64_t)(suspend_after_ms > 0 ? suspend_after_ms : PONY_SCHED_SUSPEND_AFTER_MS) * 1000000;
+    revive_backlog = revive_backlog_actors > 0 ? revive_backlog_actors : PONY_SCHED_REVIVE_BACKLOG;
+    
     atomic_store_explicit(&active_scheduler_count, scheduler_count, memory_order_relaxed);
-    atomic_store_explicit(&active_scheduler_count_check, scheduler_count, memory_order_relaxed);
     atomic_store_explicit(&sleeping_count, 0, memory_order_relaxed);
     scheduler = (scheduler_t*)ponyint_pool_alloc(scheduler_count * sizeof(scheduler_t));
     memset(scheduler, 0, scheduler_count * sizeof(scheduler_t));
@@ -614,15 +1092,26 @@ pony_ctx_t* ponyint_sched_init(int force_scheduler_count, int minimum_scheduler_
         scheduler[i].ctx.scheduler = &scheduler[i];
         scheduler[i].last_victim = &scheduler[i];
         scheduler[i].index = i;
+        scheduler[i].cpu = -1;
+        scheduler[i].spin_ns = spin_max_ns;
+        scheduler[i].idle_gap_ns = spin_max_ns / 2;
         ponyint_messageq_init(&scheduler[i].mq);
-        ponyint_mpmcq_init(&scheduler[i].q);
+        for(int lane = 0; lane < PONY_SCHED_LANES; lane++)
+            ponyint_deque_init(&scheduler[i].q[lane]);
         ponyint_park_init(&scheduler[i].park);
         atomic_store_explicit(&scheduler[i].parked, false, memory_order_relaxed);
     }
     
-    ponyint_mpmcq_init(&inject);
-    ponyint_mpmcq_init(&injectHighEfficiency);
-    ponyint_mpmcq_init(&injectHighPerformance);
+    for(int lane = 0; lane < PONY_SCHED_LANES; lane++)
+    {
+        ponyint_mpmcq_init(&inject[lane], offsetof(pony_actor_t, inject_next));
+        ponyint_mpmcq_init(&injectHighEfficiency[lane], offsetof(pony_actor_t, inject_next));
+        ponyint_mpmcq_init(&injectHighPerformance[lane], offsetof(pony_actor_t, inject_next));
+    }
+    
+    atomic_store_explicit(&external_scheduled, 0, memory_order_relaxed);
+    atomic_store_explicit(&quiescence_waiting, false, memory_order_relaxed);
+    ponyint_park_init(&quiescence_park);
 
     // Only now is every park initialised and safe for another thread to touch.
     atomic_store_explicit(&schedulers_running, true, memory_order_release);
@@ -673,6 +1162,19 @@ bool ponyint_sched_start()
                      "FATAL: %u efficiency / %u performance schedulers -- actors routed to the "
                      "empty class will never run", n_e, n_p);
     }
+    
+    // Schedulers suspend from the top down, and the efficiency schedulers are
+    // at the bottom; keep at least one performance scheduler active.
+    if (min_active_count < e_schedulers + 1) {
+        min_active_count = e_schedulers + 1;
+    }
+    if (min_active_count < scheduler_count) {
+        pony_syslog2("Flynn",
+                     "elastic scheduling: %u to %u active schedulers, suspending after %llums idle, reviving at a backlog of %lld actors",
+                     min_active_count, scheduler_count, (unsigned long long)(suspend_after_ns / 1000000), (long long)revive_backlog);
+    }
+    
+    sched_build_victims();
 
 
     for(uint32_t i = start; i < scheduler_count; i++)
@@ -688,49 +1190,41 @@ bool ponyint_sched_start()
     return true;
 }
 
+/**
+ * True if, at some instant during the call, no actor was queued or running.
+ * Every unscheduled count is read before any scheduled count: an actor is
+ * counted as scheduled before it can be run, so the scheduled total read can
+ * only be too high, never too low. If it still matches the unscheduled total
+ * then both held at the moment the first scheduled count was read.
+ */
+static bool sched_quiescent(void)
+{
+    uint64_t unscheduled = 0;
+    uint64_t scheduled = 0;
+    
+    for(uint32_t i = 0; i < scheduler_count; i++)
+        unscheduled += atomic_load_explicit(&scheduler[i].unscheduled, memory_order_acquire);
+    
+    scheduled += atomic_load_explicit(&external_scheduled, memory_order_acquire);
+    for(uint32_t i = 0; i < scheduler_count; i++)
+        scheduled += atomic_load_explicit(&scheduler[i].scheduled, memory_order_acquire);
+    
+    return scheduled == unscheduled;
+}
+
 void ponyint_sched_wait(bool waitForRemotes)
 {
-    // block until no local actors or remote actors are in existance for
-    // for the specified amount of time.
-    int32_t usSleep = 5000;
-    int32_t numRepeatIdle = (1000 * 1000) / usSleep;
-    int32_t timesIdle = numRepeatIdle;
+    // block until no local actors are queued or running, and no remote actors
+    // are in existance.
+    atomic_store_explicit(&quiescence_waiting, true, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
     
-    while(true) {
-        uint32_t active = 0;
-        
-        for(uint32_t i = 0; i < scheduler_count; i++) {
-            if (atomic_load_explicit(&scheduler[i].idle, memory_order_relaxed) == false) {
-                active += 1;
-            }
-        }
-        
-        // in order to be able to shutdown, all schedules must be idle
-        // all injection queues must be empty
-        // all remote actors must be destroyed
-        /*
-         pony_syslog2("Flynn", "%d  %d  %d  %d  %d\n",
-                active,
-                (int)inject.num_messages,
-                (int)injectHighEfficiency.num_messages,
-                (int)injectHighPerformance.num_messages,
-                pony_root_num_active_remotes() );
-         */
-        if (active == 0 &&
-            inject.num_messages == 0 &&
-            injectHighEfficiency.num_messages == 0 &&
-            injectHighPerformance.num_messages == 0 &&
-            (waitForRemotes == false || pony_root_num_active_remotes() == 0)) {
-            timesIdle--;
-            if (timesIdle <= 0) {
-                break;
-            }
-        } else {
-            timesIdle = numRepeatIdle;
-        }
-        
-        ponyint_cpu_sleep(usSleep);
+    while(!sched_quiescent() ||
+          (waitForRemotes && pony_root_num_active_remotes() != 0)) {
+        ponyint_park_wait(&quiescence_park, QUIESCENCE_BACKSTOP_US);
     }
+    
+    atomic_store_explicit(&quiescence_waiting, false, memory_order_relaxed);
 }
 
 void ponyint_sched_stop()
@@ -741,16 +1235,27 @@ void ponyint_sched_stop()
 void ponyint_sched_add(pony_ctx_t* ctx, pony_actor_t* actor)
 {
     if(ctx->scheduler != NULL) {
+        sched_count(&ctx->scheduler->scheduled);
         // push() wakes a sleeper itself
         push(ctx->scheduler, actor);
     } else {
         // Sends from threads that are not schedulers -- the timer loop, remote
         // node threads, the main thread -- land here. pony_register_thread()
         // zeroes its placeholder scheduler_t, so ctx->scheduler is NULL for
-        // them and all of their work funnels through the inject queue.
-        // Every scheduler pops inject first, regardless of affinity.
-        ponyint_mpmcq_push(&inject, actor);
+        // them and all of their work funnels through the inject queues.
+        // Every scheduler pops inject first within a lane, regardless of
+        // affinity.
+        int lane = sched_lane(actor);
+        atomic_fetch_add_explicit(&external_scheduled, 1, memory_order_release);
+        atomic_fetch_add_explicit(&inject_backlog[lane], 1, memory_order_relaxed);
+        ponyint_mpmcq_push(&inject[lane], actor);
         wake_one_sleeper(kCoreAffinity_None);
+        
+        // Nobody pops inject while every active scheduler is stuck in a long
+        // behaviour, so a backlog building up here would otherwise never be
+        // seen by sched_check_load().
+        if(atomic_load_explicit(&schedulers_running, memory_order_acquire))
+            sched_check_load(NULL);
     }
 }
 
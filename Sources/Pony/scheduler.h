@@ -8,6 +8,7 @@
 
 #include <stdalign.h>
 #include "mpmcq.h"
+#include "deque.h"
 #include "threads.h"
 
 typedef struct scheduler_t scheduler_t;
@@ -17,6 +18,11 @@ typedef struct scheduler_t scheduler_t;
 // default actor priority
 #define PONY_DEFAULT_ACTOR_PRIORITY 0
 
+// Runnable actors wait in one of these lanes, chosen by how their priority
+// compares to the default: below it, at it, or above it. Higher lanes are
+// served first; see pop_global().
+#define PONY_SCHED_LANES 3
+
 #define SPECIAL_THREADID_KQUEUE   -10
 #define SPECIAL_THREADID_IOCP     -11
 #define SPECIAL_THREADID_EPOLL    -12
@@ -25,6 +31,10 @@ typedef struct scheduler_t scheduler_t;
 typedef struct pony_ctx_t
 {
     scheduler_t* scheduler;
+
+    // The actor this thread is running, if any; it is the one muted when a
+    // send finds the receiver over its mailbox limit.
+    pony_actor_t* current;
 } pony_ctx_t;
 
 struct scheduler_t
@@ -33,16 +43,33 @@ struct scheduler_t
     pony_thread_id_t tid;
     int32_t index;
     int32_t coreAffinity;
+    int32_t cpu;
     PONY_ATOMIC(bool) idle;
     PONY_ATOMIC(bool) terminate;
     
     // These are changed primarily by the owning scheduler thread.
     alignas(64) struct scheduler_t* last_victim;
+    struct scheduler_t** victims;       // every other scheduler, nearest first
+    uint32_t lane_pops;
+    uint64_t steals;
+    uint64_t stolen_actors;
+    uint64_t largest_steal;
+    
+    // Idle policy; see sched_adapt_spin().
+    uint64_t spin_ns;
+    uint64_t idle_gap_ns;
+    uint64_t spin_hits;
+    uint64_t parks;
+    
+    // Actors this scheduler has made runnable, and actors it has run and not
+    // put back. Each only ever grows; see sched_quiescent().
+    PONY_ATOMIC(uint64_t) scheduled;
+    PONY_ATOMIC(uint64_t) unscheduled;
     
     pony_ctx_t ctx;
     
-    // These are accessed by other scheduler threads. The mpmcq_t is aligned.
-    mpmcq_t q;
+    // These are accessed by other scheduler threads. The deque_t is aligned.
+    deque_t q[PONY_SCHED_LANES];
     messageq_t mq;
 
     // Sleep/wake state. parked is published by the owner just before it commits
@@ -50,11 +77,17 @@ struct scheduler_t
     // the lines the owner touches while it is actually running.
     alignas(64) PONY_ATOMIC(bool) parked;
     pony_park_t park;
+    
+    // Set while the scheduler is suspended by the elastic policy. A suspended
+    // scheduler is not parked: wake_one_sleeper() never picks it, and only
+    // sched_revive() brings it back.
+    PONY_ATOMIC(bool) suspended;
 };
 
 pony_ctx_t* pony_ctx(void);
 
-pony_ctx_t* ponyint_sched_init(int force_scheduler_count, int minimum_scheduler_count);;
+pony_ctx_t* ponyint_sched_init(int force_scheduler_count, int minimum_scheduler_count,
+                               int minimum_active_count, int suspend_after_ms, int revive_backlog);
 
 bool ponyint_sched_start(void);
 
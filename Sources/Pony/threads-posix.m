@@ -5,6 +5,7 @@
 #ifndef PLATFORM_IS_WINDOWS
 
 #define _GNU_SOURCE
+#define PONY_WANT_ATOMIC_DEFS
 
 #include "threads.h"
 #include "ponyrt.h"
@@ -24,6 +25,56 @@
 #include <Foundation/Foundation.h>
 #endif
 
+#ifdef PLATFORM_IS_LINUX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define PONY_PARK_IDLE 0
+#define PONY_PARK_WOKEN 1
+#define PONY_PARK_PARKED 2
+
+void ponyint_park_init(pony_park_t* park) {
+    atomic_store_explicit(&park->state, PONY_PARK_IDLE, memory_order_relaxed);
+}
+
+void ponyint_park_destroy(pony_park_t* park) {
+    (void)park;
+}
+
+void ponyint_park_wait(pony_park_t* park, uint64_t timeout_us) {
+    // If a wake landed while we were deciding to park, consume it and return
+    // without sleeping. Otherwise advertise that we are about to sleep.
+    uint32_t expected = PONY_PARK_IDLE;
+    if (atomic_compare_exchange_strong_explicit(&park->state, &expected, PONY_PARK_PARKED,
+                                                memory_order_acq_rel, memory_order_acquire)) {
+        // FUTEX_WAIT's timeout is relative and measured against
+        // CLOCK_MONOTONIC, so wall clock changes cannot disturb it. A wake
+        // between the exchange above and the wait changes the word, and the
+        // kernel then returns at once rather than sleeping.
+        struct timespec ts;
+        ts.tv_sec = (time_t)(timeout_us / 1000000);
+        ts.tv_nsec = (long)((timeout_us % 1000000) * 1000);
+        syscall(SYS_futex, &park->state, FUTEX_WAIT_PRIVATE, PONY_PARK_PARKED, &ts, NULL, 0);
+    }
+
+    // Spurious wakeups need no loop here: the caller's response to waking is to
+    // go re-poll the queues, which is exactly the right thing to do anyway.
+    // Exchange rather than store, so that a wake racing our return is consumed
+    // with acquire ordering -- we see whatever it published -- instead of being
+    // overwritten.
+    atomic_exchange_explicit(&park->state, PONY_PARK_IDLE, memory_order_acquire);
+}
+
+void ponyint_park_wake(pony_park_t* park) {
+    // Only ever one waiter per park, and only a parked one needs the kernel;
+    // waking an idle or already woken park just leaves the flag for it.
+    if (atomic_exchange_explicit(&park->state, PONY_PARK_WOKEN, memory_order_acq_rel) == PONY_PARK_PARKED) {
+        syscall(SYS_futex, &park->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+#else
+
 void ponyint_park_init(pony_park_t* park) {
     pthread_mutex_init(&park->mutex, NULL);
 #if defined(PLATFORM_IS_APPLE)
@@ -84,6 +135,8 @@ void ponyint_park_wake(pony_park_t* park) {
     pthread_mutex_unlock(&park->mutex);
 }
 
+#endif
+
 PONY_MUTEX ponyint_mutex_create() {
     pthread_mutex_t * mutex = malloc(sizeof(pthread_mutex_t));
     if (pthread_mutex_init(mutex, NULL) != 0) {
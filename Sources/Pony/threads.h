@@ -47,12 +47,27 @@
     
     #define __pony_thread_local __thread
 
+#ifdef PLATFORM_IS_LINUX
+
+    #include "atomics.h"
+
+    // A single futex word: PONY_PARK_IDLE, PONY_PARK_WOKEN or PONY_PARK_PARKED.
+    // A wake only makes a syscall when it finds the waiter actually parked.
+    typedef struct pony_park_t
+    {
+        PONY_ATOMIC(uint32_t) state;
+    } pony_park_t;
+
+#else
+
     typedef struct pony_park_t
     {
         pthread_mutex_t mutex;
         pthread_cond_t cond;
         bool signalled;
     } pony_park_t;
+
+#endif
     
 #endif
 
@@ -0,0 +1,47 @@
+import XCTest
+
+import Flynn
+
+final class FlynnMemoryTests: XCTestCase {
+
+    override func setUp() {
+        Flynn.startup()
+    }
+
+    override func tearDown() {
+        Flynn.shutdown()
+    }
+
+    func testPoolStatsCountMessageTraffic() {
+        let expectation = XCTestExpectation(description: #function)
+
+        let numMessages = 50_000
+        let actor = Actor()
+
+        let countdown = Countdown(numMessages, expectation)
+
+        for _ in 0..<numMessages {
+            actor.unsafeSend { _ in
+                countdown.done()
+            }
+        }
+
+        wait(for: [expectation], timeout: 30.0)
+
+        let samples = Flynn.Memory.collect()
+        XCTAssertFalse(samples.isEmpty)
+
+        // Every message is allocated by this thread and freed by a scheduler,
+        // so across all threads the pool must have served at least as many
+        // allocations and seen at least as many frees.
+        let allocations = samples.reduce(UInt64(0)) { $0 + $1.allocations }
+        let frees = samples.reduce(UInt64(0)) { $0 + $1.frees }
+        XCTAssertGreaterThanOrEqual(allocations, UInt64(numMessages))
+        XCTAssertGreaterThanOrEqual(frees, UInt64(numMessages))
+
+        for sample in samples {
+            XCTAssertGreaterThan(sample.size, 0)
+            XCTAssertLessThanOrEqual(sample.hitRate, 1.0)
+        }
+    }
+}
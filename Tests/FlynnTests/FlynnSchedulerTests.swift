@@ -0,0 +1,192 @@
+import XCTest
+
+import Flynn
+
+final class FlynnSchedulerTests: XCTestCase {
+
+    override func setUp() {
+        Flynn.startup()
+    }
+
+    override func tearDown() {
+        Flynn.shutdown()
+    }
+
+    func testStealBatchesAreBounded() {
+        let expectation = XCTestExpectation(description: #function)
+
+        let numWorkers = 2000
+        let workers = Array(count: numWorkers) { Actor() }
+        let fanout = Actor()
+
+        let countdown = Countdown(numWorkers, expectation)
+
+        // One actor sends to every worker, so every worker lands on a single
+        // scheduler's queue and the rest have to steal it off.
+        fanout.unsafeSend { _ in
+            for worker in workers {
+                worker.unsafeSend { _ in
+                    if busyWork().isFinite {
+                        countdown.done()
+                    }
+                }
+            }
+        }
+
+        wait(for: [expectation], timeout: 30.0)
+
+        let samples = Flynn.Scheduler.collect()
+        XCTAssertEqual(samples.count, Flynn.Scheduler.count)
+        for sample in samples {
+            XCTAssertLessThanOrEqual(sample.largestSteal, UInt64(Flynn.Scheduler.stealBatchLimit))
+            XCTAssertGreaterThanOrEqual(sample.stolenActors, sample.steals)
+        }
+
+        // The bounds above hold just as well if nothing was stolen at all.
+        // Make sure something was, and that a visit did move a batch.
+        XCTAssertGreaterThan(samples.reduce(0) { $0 + $1.steals }, 0)
+        XCTAssertGreaterThan(samples.map { $0.largestSteal }.max() ?? 0, 1)
+    }
+
+    func testEveryRunnableActorMakesProgress() {
+        let expectation = XCTestExpectation(description: #function)
+
+        let numActors = Flynn.Scheduler.count * 16
+        let hopsEach = 100
+        let actors = Array(count: numActors) { Actor() }
+
+        let countdown = Countdown(numActors, expectation)
+
+        // Every actor stays runnable by sending to itself until all of them
+        // have made their hops. A scheduler that kept running the actors it
+        // just put back would leave the rest waiting for as long as those
+        // keep going, which here is forever.
+        func hop(_ actor: Actor, _ hops: Int) {
+            if hops == hopsEach {
+                countdown.done()
+            }
+            guard countdown.remaining > 0 else { return }
+            actor.unsafeSend { _ in hop(actor, hops + 1) }
+        }
+        for actor in actors {
+            actor.unsafeMessageBatchSize = 1
+            actor.unsafeSend { _ in hop(actor, 1) }
+        }
+
+        wait(for: [expectation], timeout: 30.0)
+    }
+
+    func testSchedulersReviveForWorkFromOtherThreads() {
+        Flynn.shutdown()
+        Flynn.startup(schedulerCount: 4,
+                      minActiveSchedulerCount: 1,
+                      schedulerSuspendAfterMS: 20,
+                      schedulerReviveBacklog: 4)
+
+        // Give the idle schedulers time to suspend.
+        let idleBy = Date().addingTimeInterval(5.0)
+        while Flynn.Scheduler.activeCount == Flynn.Scheduler.count && Date() < idleBy {
+            usleep(10_000)
+        }
+        let idleCount = Flynn.Scheduler.activeCount
+        XCTAssertLessThan(idleCount, Flynn.Scheduler.count)
+
+        let expectation = XCTestExpectation(description: #function)
+
+        let numWorkers = 200
+        let workers = Array(count: numWorkers) { Actor() }
+
+        let countdown = Countdown(numWorkers, expectation)
+
+        // Tie up every active scheduler in a long behaviour, then queue the
+        // work from this thread, which is not a scheduler. None of it reaches
+        // a scheduler's own queue; the backlog is only on the inject queues.
+        let blockers = Array(count: idleCount) { Actor() }
+        for blocker in blockers {
+            blocker.unsafeSend { _ in usleep(500_000) }
+        }
+        usleep(20_000)
+        for worker in workers {
+            worker.unsafeSend { _ in
+                if busyWork().isFinite {
+                    countdown.done()
+                }
+            }
+        }
+
+        var peak = idleCount
+        let until = Date().addingTimeInterval(0.4)
+        while Date() < until {
+            peak = max(peak, Flynn.Scheduler.activeCount)
+            usleep(1_000)
+        }
+        XCTAssertGreaterThan(peak, idleCount)
+
+        wait(for: [expectation], timeout: 30.0)
+    }
+
+    func testIdleSpinStaysWithinLimit() {
+        let expectation = XCTestExpectation(description: #function)
+
+        let ping = Actor()
+        let pong = Actor()
+
+        let countdown = Countdown(1000, expectation)
+
+        // A ping-pong leaves schedulers idle for short, regular gaps, which is
+        // what the spin policy learns from.
+        func bounce() {
+            countdown.done()
+            guard countdown.remaining > 0 else { return }
+            pong.unsafeSend { _ in
+                ping.unsafeSend { _ in bounce() }
+            }
+        }
+        ping.unsafeSend { _ in bounce() }
+
+        wait(for: [expectation], timeout: 30.0)
+
+        let limitNS = UInt64(Flynn.Scheduler.spinLimitUS) * 1000
+        let samples = Flynn.Scheduler.collect()
+        XCTAssertGreaterThan(samples.reduce(0) { $0 + $1.spinHits + $1.parks }, 0)
+        for sample in samples {
+            XCTAssertLessThanOrEqual(sample.spinNS, limitNS)
+            XCTAssertGreaterThanOrEqual(sample.spinHitRate, 0.0)
+            XCTAssertLessThanOrEqual(sample.spinHitRate, 1.0)
+        }
+    }
+
+    func testHighPriorityRunsAheadOfBulk() {
+        let expectation = XCTestExpectation(description: #function)
+
+        let numWorkers = 2000
+        let workers = Array(count: numWorkers) { Actor() }
+        let control = Actor()
+        control.unsafePriority = 10
+        let fanout = Actor()
+
+        let countdown = Countdown(numWorkers, expectation)
+        var remainingWhenControlRan = 0
+
+        // The control message goes in the middle of the bulk work, so without
+        // its own lane it would wait for about half the bulk to run first.
+        fanout.unsafeSend { _ in
+            for (idx, worker) in workers.enumerated() {
+                if idx == numWorkers / 2 {
+                    control.unsafeSend { _ in
+                        remainingWhenControlRan = countdown.remaining
+                    }
+                }
+                worker.unsafeSend { _ in
+                    if busyWork().isFinite {
+                        countdown.done()
+                    }
+                }
+            }
+        }
+
+        wait(for: [expectation], timeout: 30.0)
+
+        XCTAssertGreaterThan(remainingWhenControlRan, numWorkers * 3 / 4)
+    }
+}
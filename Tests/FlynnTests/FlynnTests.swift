@@ -579,6 +579,108 @@ class FlynnTests: XCTestCase {
         }
     }
 
+    func testSendBatchRunsInOrder() {
+        let expectation = XCTestExpectation(description: #function)
+        
+        let actor = Actor()
+        let numBlocks = 500
+        var received: [Int] = []
+        
+        var blocks: [PonyBlock] = []
+        for idx in 0..<numBlocks {
+            blocks.append { _ in
+                received.append(idx)
+                if received.count == numBlocks {
+                    expectation.fulfill()
+                }
+            }
+        }
+        actor.unsafeSendBatch(blocks)
+        
+        wait(for: [expectation], timeout: 10.0)
+        XCTAssertEqual(received, Array(0..<numBlocks))
+    }
+    
+    func testMailboxLimitMutesSenders() {
+        let expectation = XCTestExpectation(description: #function)
+
+        let producer = Actor()
+        let consumer = Actor()
+        consumer.unsafeMailboxLimit = 100
+
+        let numMessages = 20000
+        var received = 0
+        var largestMailbox: Int32 = 0
+
+        for _ in 0..<numMessages {
+            producer.unsafeSend { _ in
+                consumer.unsafeSend { _ in
+                    Flynn.usleep(5)
+                    received += 1
+                    if received == numMessages {
+                        expectation.fulfill()
+                    }
+                }
+                largestMailbox = max(largestMailbox, consumer.unsafeMessagesCount)
+            }
+        }
+
+        wait(for: [expectation], timeout: 30.0)
+        XCTAssertLessThanOrEqual(largestMailbox, consumer.unsafeMailboxLimit + 1)
+    }
+
+    func testMailboxLimitPingPongDoesNotDeadlock() {
+        let expectation = XCTestExpectation(description: #function)
+
+        let ping = Actor()
+        let pong = Actor()
+        ping.unsafeMailboxLimit = 10
+        pong.unsafeMailboxLimit = 10
+
+        let depth = 9
+        let numSeeds = 50
+        let expected = numSeeds * ((1 << (depth + 1)) - 1)
+
+        let lock = NSLock()
+        var hops = 0
+
+        // Every message sends two more to the other actor, so both mailboxes
+        // are past their limits while each is sending to the other. Muting
+        // either one on the other would leave neither able to drain.
+        func bounce(_ from: Actor, _ to: Actor, _ remaining: Int) {
+            lock.lock()
+            hops += 1
+            let done = hops == expected
+            lock.unlock()
+            if done {
+                expectation.fulfill()
+            }
+            guard remaining > 0 else { return }
+            for _ in 0..<2 {
+                to.unsafeSend { _ in bounce(to, from, remaining - 1) }
+            }
+        }
+
+        for _ in 0..<numSeeds {
+            ping.unsafeSend { _ in bounce(ping, pong, depth) }
+        }
+
+        wait(for: [expectation], timeout: 30.0)
+    }
+
+    func testActorIdentity() {
+        let actors = Array(count: 1000) { Actor() }
+        
+        let uids = Set(actors.map { $0.unsafeUID })
+        XCTAssertEqual(uids.count, actors.count)
+        XCTAssertEqual(Set(actors).count, actors.count)
+        
+        let first = actors[0]
+        XCTAssertEqual(first.unsafeUUID, first.unsafeUUID)
+        XCTAssertEqual(first.unsafeUUID.count, 36)
+        XCTAssertNotEqual(first.unsafeUUID, actors[1].unsafeUUID)
+    }
+
     func testShutdown() {
         let expectation = XCTestExpectation(description: #function)
 
@@ -0,0 +1,39 @@
+import XCTest
+
+// Counts completions from any actor and fulfills the expectation on the last.
+final class Countdown {
+    private let lock = NSLock()
+    private let expectation: XCTestExpectation
+    private var count: Int
+
+    init(_ count: Int, _ expectation: XCTestExpectation) {
+        self.count = count
+        self.expectation = expectation
+    }
+
+    var remaining: Int {
+        lock.lock()
+        defer { lock.unlock() }
+        return count
+    }
+
+    func done() {
+        lock.lock()
+        count -= 1
+        let finished = count == 0
+        lock.unlock()
+        if finished {
+            expectation.fulfill()
+        }
+    }
+}
+
+// Keeps a scheduler busy for a moment. Use the result, or the loop may be
+// optimised away.
+func busyWork(_ iterations: Int = 2_000) -> Double {
+    var acc = 0.0
+    for i in 0..<iterations {
+        acc += sin(Double(i))
+    }
+    return acc
+}